@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cast.h"
+#include "perf.h"
+
+/* A cast never has canvas larger than this on either axis, a larger one means the cast is damaged. */
+#define CAST_MAX_SIZE 10000
+
+/* Make room for this many more bytes of frame encoding. Return false only on failure. */
+static bool cast_reserve(struct cast *c, size_t len)
+{
+	if (c->len + len <= c->cap) {
+		return true;
+	}
+	size_t cap = c->cap * 2 + len + 4096;
+	uint8_t *buf = realloc(c->buf, cap);
+	if (!buf) {
+		return false;
+	}
+	c->buf = buf;
+	c->cap = cap;
+	return true;
+}
+
+/* Append the number in LEB128 to the buffer, which must have room for 10 more bytes. Return the bytes appended. */
+static size_t cast_put_num(uint8_t *buf, uint64_t num)
+{
+	size_t len = 0;
+	while (num >= 0x80) {
+		buf[len++] = (num & 0x7f) | 0x80;
+		num >>= 7;
+	}
+	buf[len++] = num;
+	return len;
+}
+
+/* Append a run of characters, which begins skip characters after the end of previous run. Return false only on failure. */
+static bool cast_put_run(struct cast *c, const uint32_t *chars,
+			 const uint32_t *attrs, size_t skip, size_t begin,
+			 size_t end)
+{
+	/* Two numbers for the run, at most a code point and an attribute for every character */
+	if (!cast_reserve(c, 20 + (end - begin) * 10)) {
+		return false;
+	}
+	c->len += cast_put_num(c->buf + c->len, skip);
+	c->len += cast_put_num(c->buf + c->len, end - begin);
+	uint32_t attr = (begin > 0) ? attrs[begin - 1] : 0;
+	size_t i;
+	for (i = begin; i < end; i++) {
+		bool new_attr = attrs[i] != attr;
+		c->len += cast_put_num(c->buf + c->len,
+				       (uint64_t)chars[i] * 2 + new_attr);
+		if (new_attr) {
+			c->len += cast_put_num(c->buf + c->len, attrs[i]);
+			attr = attrs[i];
+		}
+	}
+	memcpy(c->chars + begin, chars + begin,
+	       (end - begin) * sizeof(uint32_t));
+	memcpy(c->attrs + begin, attrs + begin,
+	       (end - begin) * sizeof(uint32_t));
+	return true;
+}
+
+/* Make the latest frame as large as the canvas. Return true only if it has been resized. */
+static bool cast_resize(struct cast *c, int width, int height)
+{
+	if (c->chars != NULL && width == c->width && height == c->height) {
+		return false;
+	}
+	free(c->chars);
+	free(c->attrs);
+	/* No character of canvas is 0, every one of them differs */
+	c->chars = calloc((size_t)width * height + 1, sizeof(uint32_t));
+	c->attrs = calloc((size_t)width * height + 1, sizeof(uint32_t));
+	if (!c->chars || !c->attrs) {
+		free(c->chars);
+		free(c->attrs);
+		c->chars = NULL;
+		c->attrs = NULL;
+	}
+	c->width = width;
+	c->height = height;
+	return true;
+}
+
+bool cast_start(struct cast *c, const char *path)
+{
+	memset(c, 0, sizeof(struct cast));
+	c->file = fopen(path, "wb");
+	if (!c->file) {
+		fprintf(stderr, "Failed to open cast file %s\n", path);
+		return false;
+	}
+	if (fwrite(CAST_MAGIC, 1, 8, c->file) != 8) {
+		fprintf(stderr, "Failed to write cast header to %s\n", path);
+		fclose(c->file);
+		c->file = NULL;
+		return false;
+	}
+	c->start_usec = perf_now_usec();
+	c->last_usec = c->start_usec;
+	c->last_flush_usec = c->start_usec;
+	return true;
+}
+
+bool cast_frame(struct cast *c, caca_canvas_t * canvas, long long now_usec)
+{
+	int width = caca_get_canvas_width(canvas);
+	int height = caca_get_canvas_height(canvas);
+	const uint32_t *chars = caca_get_canvas_chars(canvas);
+	const uint32_t *attrs = caca_get_canvas_attrs(canvas);
+	bool resized = cast_resize(c, width, height);
+	if (!c->chars) {
+		return false;
+	}
+	/*
+	 * Find runs of changed characters, skipping unchanged rows at once. A run continues past a few
+	 * unchanged characters and across the end of row.
+	 */
+	c->len = 0;
+	size_t num_runs = 0, prev_end = 0, begin = 0, end = 0;
+	bool in_run = false;
+	int x, y;
+	for (y = 0; y < height; y++) {
+		size_t row = (size_t)y * width;
+		if (!resized
+		    && memcmp(chars + row, c->chars + row,
+			      width * sizeof(uint32_t)) == 0
+		    && memcmp(attrs + row, c->attrs + row,
+			      width * sizeof(uint32_t)) == 0) {
+			continue;
+		}
+		for (x = 0; x < width; x++) {
+			size_t i = row + x;
+			if (chars[i] == c->chars[i]
+			    && attrs[i] == c->attrs[i]) {
+				continue;
+			}
+			if (in_run && i - end <= CAST_MAX_GAP) {
+				end = i + 1;
+				continue;
+			}
+			if (in_run) {
+				if (!cast_put_run(c, chars, attrs,
+						  begin - prev_end, begin,
+						  end)) {
+					return false;
+				}
+				prev_end = end;
+				num_runs++;
+			}
+			in_run = true;
+			begin = i;
+			end = i + 1;
+		}
+	}
+	if (in_run) {
+		if (!cast_put_run(c, chars, attrs, begin - prev_end, begin,
+				  end)) {
+			return false;
+		}
+		num_runs++;
+	}
+	if (num_runs == 0 && !resized) {
+		return true;
+	}
+	uint8_t head[40];
+	size_t head_len = 0;
+	head_len += cast_put_num(head + head_len, now_usec - c->last_usec);
+	head_len += cast_put_num(head + head_len, width);
+	head_len += cast_put_num(head + head_len, height);
+	head_len += cast_put_num(head + head_len, num_runs);
+	if (fwrite(head, 1, head_len, c->file) != head_len
+	    || fwrite(c->buf, 1, c->len, c->file) != c->len) {
+		return false;
+	}
+	c->frames++;
+	c->bytes += head_len + c->len;
+	c->last_usec = now_usec;
+	/* Most frames stay in stdio buffer, a crash loses at most the latest moment of cast */
+	long long done = perf_now_usec();
+	if (done - c->last_flush_usec >= CAST_FLUSH_USEC) {
+		c->last_flush_usec = done;
+		if (fflush(c->file) != 0) {
+			return false;
+		}
+	}
+	c->usec += done - now_usec;
+	return true;
+}
+
+void cast_stop(struct cast *c)
+{
+	if (c->file != NULL) {
+		fclose(c->file);
+	}
+	free(c->chars);
+	free(c->attrs);
+	free(c->buf);
+	memset(c, 0, sizeof(struct cast));
+}
+
+/* Read a LEB128 number from the cast. Return false at the end of file or on failure. */
+static bool cast_get_num(struct cast_reader *r, uint64_t *num)
+{
+	*num = 0;
+	int shift, b;
+	for (shift = 0; shift < 64; shift += 7) {
+		b = getc(r->file);
+		if (b == EOF) {
+			return false;
+		}
+		*num |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool cast_reader_open(struct cast_reader *r, const char *path)
+{
+	memset(r, 0, sizeof(struct cast_reader));
+	r->file = fopen(path, "rb");
+	if (!r->file) {
+		fprintf(stderr, "Failed to open cast file %s\n", path);
+		return false;
+	}
+	char magic[8];
+	if (fread(magic, 1, 8, r->file) != 8
+	    || memcmp(magic, CAST_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s is not a cast of headmore\n", path);
+		fclose(r->file);
+		r->file = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool cast_reader_next(struct cast_reader *r, caca_canvas_t * canvas,
+		      long long *delay_usec)
+{
+	uint64_t delay, width, height, num_runs;
+	/* A cast may end after any complete frame */
+	int b = getc(r->file);
+	if (b == EOF) {
+		r->failed = ferror(r->file);
+		return false;
+	}
+	ungetc(b, r->file);
+	r->failed = true;
+	if (!cast_get_num(r, &delay) || !cast_get_num(r, &width)
+	    || !cast_get_num(r, &height) || !cast_get_num(r, &num_runs)
+	    || width > CAST_MAX_SIZE || height > CAST_MAX_SIZE) {
+		return false;
+	}
+	if ((int)width != r->width || (int)height != r->height) {
+		caca_set_canvas_size(canvas, width, height);
+		r->width = width;
+		r->height = height;
+	}
+	size_t size = (size_t)width * height, pos = 0;
+	uint64_t run;
+	for (run = 0; run < num_runs; run++) {
+		uint64_t skip, len, num, attr = 0;
+		if (!cast_get_num(r, &skip) || !cast_get_num(r, &len)
+		    || skip > size - pos || len > size - pos - skip) {
+			return false;
+		}
+		pos += skip;
+		if (pos > 0) {
+			attr = caca_get_attr(canvas, (pos - 1) % width,
+					     (pos - 1) / width);
+		}
+		for (; len > 0; len--, pos++) {
+			if (!cast_get_num(r, &num)) {
+				return false;
+			}
+			if ((num & 1) && !cast_get_num(r, &attr)) {
+				return false;
+			}
+			/* Putting a full-width character fills in its right half */
+			if (num / 2 == CACA_MAGIC_FULLWIDTH) {
+				continue;
+			}
+			caca_set_attr(canvas, attr);
+			caca_put_char(canvas, pos % width, pos / width,
+				      num / 2);
+		}
+	}
+	r->failed = false;
+	*delay_usec = delay;
+	return true;
+}
+
+void cast_reader_close(struct cast_reader *r)
+{
+	if (r->file != NULL) {
+		fclose(r->file);
+	}
+	memset(r, 0, sizeof(struct cast_reader));
+}
@@ -0,0 +1,71 @@
+#ifndef CAST_H
+#define CAST_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAST_MAGIC "HMCAST01"	/* Every cast begins with these 8 bytes */
+/* Unchanged characters in between changed ones up to this many join their run, as it is cheaper than a new run. */
+#define CAST_MAX_GAP 2
+#define CAST_FLUSH_USEC 1000000	/* Frames reach the file at least this often */
+
+/*
+ * Cast of the frames shown on terminal, each frame stores only the characters that differ from the
+ * frame before it. A cast consists of:
+ * - The magic.
+ * - Frames, each frame is its time since the previous frame (since the beginning of cast for the
+ *   first one) in microseconds, canvas width, canvas height, the number of runs, and the runs.
+ * - A run is the number of unchanged characters since the end of previous run (counting row by row
+ *   from the top left), the number of characters in the run, and the characters. A character is
+ *   its code point times 2, plus 1 if its attribute follows, and then the attribute if it differs
+ *   from the character before it in the run.
+ * Every integer is an unsigned LEB128 number (7 bits a byte, the lowest first). The first frame, and
+ * a frame of a different size than the one before it, store every character.
+ * Frames without changes are not stored, an idle terminal costs nothing.
+ */
+struct cast {
+	FILE *file;
+	long long start_usec, last_usec, last_flush_usec;
+	/* Characters and attributes of the latest stored frame */
+	int width, height;
+	uint32_t *chars, *attrs;
+	/* Encoding of the frame being stored */
+	uint8_t *buf;
+	size_t len, cap;
+	/* Frames stored, their bytes, and time spent on storing them */
+	unsigned long frames;
+	unsigned long long bytes;
+	long long usec;
+};
+
+/* Read back the frames of a cast. */
+struct cast_reader {
+	FILE *file;
+	int width, height;
+	/* Set if the cast is damaged or cannot be read, as opposed to having ended */
+	bool failed;
+};
+
+/* Begin a cast into the file. Return false only on failure. */
+bool cast_start(struct cast *c, const char *path);
+/* Store the characters of canvas that differ from the latest frame, as a frame shown at the time. Return false only on IO failure. */
+bool cast_frame(struct cast *c, caca_canvas_t * canvas, long long now_usec);
+/* Flush and close the cast. */
+void cast_stop(struct cast *c);
+
+/* Open the cast for reading. Return false only on failure. */
+bool cast_reader_open(struct cast_reader *r, const char *path);
+/*
+ * Apply the next frame onto the canvas, which holds the frame before it (the canvas is resized as
+ * the frame says), and tell its time since the previous frame. Return false at the end of cast or
+ * on failure, which sets failed.
+ */
+bool cast_reader_next(struct cast_reader *r, caca_canvas_t * canvas,
+		      long long *delay_usec);
+/* Close the cast. */
+void cast_reader_close(struct cast_reader *r);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <string.h>
 #include "geo.h"
 
@@ -9,8 +10,7 @@ geo_facts_of(struct vnc *vnc, caca_display_t * disp, caca_canvas_t * view)
 	ret.px_height = caca_get_display_height(disp);
 	ret.ch_width = caca_get_canvas_width(view);
 	ret.ch_height = caca_get_canvas_height(view);
-	ret.vnc_width = vnc->conn->width;
-	ret.vnc_height = vnc->conn->height;
+	vnc_get_size(vnc, &ret.vnc_width, &ret.vnc_height, &ret.vnc_scale);
 	return ret;
 }
 
@@ -90,10 +90,31 @@ void geo_pan(struct geo *g, int pan_x, int pan_y)
 	}
 }
 
+void geo_resize(struct geo *g, struct geo_facts old_facts,
+		struct geo_facts facts)
+{
+	if (old_facts.vnc_width > 0 && old_facts.vnc_height > 0) {
+		g->mouse_x =
+		    (int64_t) g->mouse_x * facts.vnc_width / old_facts.vnc_width;
+		g->mouse_y =
+		    (int64_t) g->mouse_y * facts.vnc_height /
+		    old_facts.vnc_height;
+	}
+	/* Aspect ratio may have changed */
+	geo_zoom(g, facts, 0);
+}
+
 void
 geo_move_mouse(struct geo *g, struct geo_facts facts, int step_x, int step_y)
 {
+	/* Speed is in pixels of an unscaled frame-buffer */
 	int speed = g->mouse_speed[g->zoom];
+	if (facts.vnc_scale > 1) {
+		speed /= facts.vnc_scale;
+		if (speed < 1) {
+			speed = 1;
+		}
+	}
 	g->mouse_x += step_x * speed;
 	if (g->mouse_x < 0) {
 		g->mouse_x = 0;
@@ -148,3 +169,95 @@ int geo_dither_numch_x(struct geo_dither_params *params, int num_pixels_x)
 	return geo_dither_ch_px_x(params,
 				  num_pixels_x) - geo_dither_ch_px_x(params, 0);
 }
+
+int geo_scale_of(struct geo_dither_params *params)
+{
+	if (params->width <= 0 || params->height <= 0) {
+		return 1;
+	}
+	/* Pixels of the unscaled frame-buffer covered by a character */
+	int scale = params->facts.vnc_scale > 1 ? params->facts.vnc_scale : 1;
+	int px_per_ch_x = params->facts.vnc_width * scale / params->width;
+	int px_per_ch_y = params->facts.vnc_height * scale / params->height;
+	int px_per_ch = (px_per_ch_x < px_per_ch_y) ? px_per_ch_x : px_per_ch_y;
+	return (px_per_ch > GEO_SCALE_PX_PER_CH) ? px_per_ch /
+	    GEO_SCALE_PX_PER_CH : 1;
+}
+
+struct vnc_rect geo_visible_px_rect(struct geo_dither_params *params)
+{
+	struct vnc_rect ret = { 0, 0, params->facts.vnc_width,
+		params->facts.vnc_height
+	};
+	if (params->width <= 0 || params->height <= 0) {
+		return ret;
+	}
+	/* Pixels at the left/top and right/bottom edges of canvas */
+	float px_per_ch_x = (float)params->facts.vnc_width / params->width;
+	float px_per_ch_y = (float)params->facts.vnc_height / params->height;
+	float x1 = -params->x * px_per_ch_x;
+	float y1 = -params->y * px_per_ch_y;
+	float x2 = (params->facts.ch_width - params->x) * px_per_ch_x;
+	float y2 = (params->facts.ch_height - params->y) * px_per_ch_y;
+	/* Small pans stay within the margin and do not have to wait for new pixels */
+	float margin_x = (x2 - x1) * GEO_VIEWPORT_MARGIN;
+	float margin_y = (y2 - y1) * GEO_VIEWPORT_MARGIN;
+	x1 -= margin_x + 1;
+	y1 -= margin_y + 1;
+	x2 += margin_x + 1;
+	y2 += margin_y + 1;
+	if (x1 > 0) {
+		ret.x = x1;
+	}
+	if (y1 > 0) {
+		ret.y = y1;
+	}
+	if (x2 < params->facts.vnc_width) {
+		ret.w = (int)x2 - ret.x;
+	} else {
+		ret.w = params->facts.vnc_width - ret.x;
+	}
+	if (y2 < params->facts.vnc_height) {
+		ret.h = (int)y2 - ret.y;
+	} else {
+		ret.h = params->facts.vnc_height - ret.y;
+	}
+	if (ret.w < 1) {
+		ret.w = 1;
+	}
+	if (ret.h < 1) {
+		ret.h = 1;
+	}
+	return ret;
+}
+
+struct geo_rect geo_dither_ch_rect(struct geo_dither_params *params, int px_x,
+				   int px_y, int px_w, int px_h)
+{
+	struct geo_rect ret;
+	/*
+	 * Grow the rectangle by a character on each side, so that characters
+	 * partially covered by the pixels are never left out due to rounding.
+	 */
+	int x1 = geo_dither_ch_px_x(params, px_x) - 1;
+	int y1 = geo_dither_ch_px_y(params, px_y) - 1;
+	int x2 = geo_dither_ch_px_x(params, px_x + px_w) + 2;
+	int y2 = geo_dither_ch_px_y(params, px_y + px_h) + 2;
+	if (x1 < 0) {
+		x1 = 0;
+	}
+	if (y1 < 0) {
+		y1 = 0;
+	}
+	if (x2 > params->facts.ch_width) {
+		x2 = params->facts.ch_width;
+	}
+	if (y2 > params->facts.ch_height) {
+		y2 = params->facts.ch_height;
+	}
+	ret.x = x1;
+	ret.y = y1;
+	ret.width = (x2 > x1) ? x2 - x1 : 0;
+	ret.height = (y2 > y1) ? y2 - y1 : 0;
+	return ret;
+}
@@ -8,12 +8,16 @@
 #define GEO_ZOOM_STEP 1.20f
 #define GEO_ZOOM_MAX_LVL 15
 #define GEO_ZOOM_CURSOR_LVL 11	/* zoom level for zooming into mouse cursor */
+#define GEO_VIEWPORT_MARGIN 0.25	/* visible frame-buffer region grows by this much of its size on each side */
+#define GEO_SCALE_PX_PER_CH 2	/* server scales frame-buffer down as long as a character still covers this many pixels */
 
 /* Geometry facts of terminal emulator and VNC connection. */
 struct geo_facts {
 	int px_width, px_height;
 	int ch_width, ch_height;
 	int vnc_width, vnc_height;
+	/* Frame-buffer has been scaled down by server by this factor */
+	int vnc_scale;
 };
 
 /* Return geometry facts of the VNC connection and caca terminal. */
@@ -36,6 +40,9 @@ void geo_init(struct geo *g, struct geo_facts facts);
 void geo_zoom(struct geo *g, struct geo_facts facts, int offset);
 /* Pan the canvas several steps up (-y), down (+y), left (-x), or right (+x). */
 void geo_pan(struct geo *g, int pan_x, int pan_y);
+/* Keep mouse pointer on the same spot of remote desktop after frame-buffer is resized or rescaled. */
+void geo_resize(struct geo *g, struct geo_facts old_facts,
+		struct geo_facts facts);
 /* Move mouse pointer several steps up (-y) down (+y), left (-x) or right (+x).*/
 void geo_move_mouse(struct geo *g, struct geo_facts facts, int step_x,
 		    int step_y);
@@ -57,4 +64,17 @@ int geo_dither_ch_px_y(struct geo_dither_params *params, int px_y);
 /* Return (approx.) number of characters it would take to draw those pixels on X axis. */
 int geo_dither_numch_x(struct geo_dither_params *params, int num_pixels_x);
 
+/* Return the factor by which server may scale frame-buffer down without losing detail on canvas. */
+int geo_scale_of(struct geo_dither_params *params);
+/* Return the frame-buffer pixels visible on canvas plus a margin, clipped to frame-buffer. */
+struct vnc_rect geo_visible_px_rect(struct geo_dither_params *params);
+
+/* A rectangle of characters on canvas. */
+struct geo_rect {
+	int x, y, width, height;
+};
+/* Return the characters that cover the rectangle of VNC pixels, clipped to canvas. Width/height are 0 if invisible. */
+struct geo_rect geo_dither_ch_rect(struct geo_dither_params *params, int px_x,
+				   int px_y, int px_w, int px_h);
+
 #endif
@@ -0,0 +1,120 @@
+#include <string.h>
+#include "gov.h"
+
+void gov_init(struct gov *g, bool enabled, int max_fps, int latency_msec)
+{
+	memset(g, 0, sizeof(struct gov));
+	g->enabled = enabled;
+	g->target_usec = latency_msec * 1000LL;
+	g->min_intvl = 1000000 / max_fps;
+	g->max_intvl = 1000000 / GOV_MIN_FPS;
+	if (g->max_intvl < g->min_intvl) {
+		g->max_intvl = g->min_intvl;
+	}
+	g->frame_intvl = g->min_intvl;
+	g->algorithm = GOV_FINE_ALGORITHM;
+	g->window_start_usec = perf_now_usec();
+	g->last_update_usec = g->window_start_usec;
+}
+
+/* Switch to the dithering algorithm, status row shows it and viewer_terminate reports the switches. */
+static void gov_switch(struct gov *g, const char *algorithm)
+{
+	g->algorithm = algorithm;
+	g->switches++;
+}
+
+/* Decide on frame interval and algorithm from the averages. Return true only if the decision has changed. */
+static bool gov_decide(struct gov *g, long long now)
+{
+	double secs = (now - g->window_start_usec) / 1e6;
+	float rate = g->window_updates / secs;
+	g->update_rate += (rate - g->update_rate) / 2;
+	g->window_updates = 0;
+	g->window_start_usec = now;
+	/*
+	 * Rendering and output must keep up with the frames, or frames queue up and input waits behind
+	 * them. Output time grows as terminal throughput drops, so a slow terminal gets fewer frames.
+	 */
+	float cost = g->avg_render_usec + g->avg_output_usec;
+	long long intvl = cost * GOV_HEADROOM;
+	if (intvl < g->min_intvl) {
+		intvl = g->min_intvl;
+	} else if (intvl > g->max_intvl) {
+		intvl = g->max_intvl;
+	}
+	bool changed = false;
+	/* Small fluctuations of frame time are not worth a different frame rate */
+	if (intvl < g->frame_intvl * (1 - GOV_INTVL_TOLERANCE)
+	    || intvl > g->frame_intvl * (1 + GOV_INTVL_TOLERANCE)
+	    || (intvl == g->min_intvl && g->frame_intvl != g->min_intvl)) {
+		int fps = gov_fps(g);
+		g->frame_intvl = intvl;
+		changed = gov_fps(g) != fps;
+	}
+	/* On average, a change waits for half an interval before its frame is rendered and written out */
+	bool over_target = g->frame_intvl / 2 + cost > g->target_usec;
+	if (strcmp(g->algorithm, GOV_FINE_ALGORITHM) == 0
+	    && now - g->last_update_usec < GOV_SETTLE_USEC) {
+		if (g->update_rate >= GOV_BUSY_UPDATES_PER_SEC) {
+			gov_switch(g, GOV_FAST_ALGORITHM);
+			changed = true;
+		} else if (over_target) {
+			gov_switch(g, GOV_FAST_ALGORITHM);
+			changed = true;
+		}
+	}
+	return gov_tick(g) || changed;
+}
+
+bool gov_frame(struct gov *g, struct perf_frame *f, size_t output_bytes)
+{
+	if (!g->enabled) {
+		return false;
+	}
+	long long now = perf_now_usec();
+	/* Exponential moving average over roughly the latest 8 frames */
+	if (g->samples == 0) {
+		g->avg_render_usec = f->render_usec;
+		g->avg_output_usec = f->output_usec;
+		g->avg_output_bytes = output_bytes;
+	} else {
+		g->avg_render_usec += (f->render_usec - g->avg_render_usec) / 8;
+		g->avg_output_usec += (f->output_usec - g->avg_output_usec) / 8;
+		g->avg_output_bytes +=
+		    ((float)output_bytes - g->avg_output_bytes) / 8;
+	}
+	g->samples++;
+	g->window_updates += f->updates;
+	if (f->updates > 0) {
+		g->last_update_usec = now;
+	}
+	if (now - g->window_start_usec < GOV_DECIDE_USEC) {
+		return false;
+	}
+	return gov_decide(g, now);
+}
+
+bool gov_tick(struct gov *g)
+{
+	if (!g->enabled || strcmp(g->algorithm, GOV_FINE_ALGORITHM) == 0
+	    || perf_now_usec() - g->last_update_usec < GOV_SETTLE_USEC) {
+		return false;
+	}
+	gov_switch(g, GOV_FINE_ALGORITHM);
+	return true;
+}
+
+int gov_due_msec(struct gov *g)
+{
+	if (!g->enabled || strcmp(g->algorithm, GOV_FINE_ALGORITHM) == 0) {
+		return -1;
+	}
+	long long due = g->last_update_usec + GOV_SETTLE_USEC - perf_now_usec();
+	return (due > 0) ? (due + 999) / 1000 : 0;
+}
+
+int gov_fps(struct gov *g)
+{
+	return (1000000 + g->frame_intvl / 2) / g->frame_intvl;
+}
@@ -0,0 +1,63 @@
+#ifndef GOV_H
+#define GOV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "perf.h"
+
+#define GOV_DEFAULT_LATENCY_MSEC 100
+/* Dithering while content changes fast, and once it has settled. */
+#define GOV_FAST_ALGORITHM "ordered4"
+#define GOV_FINE_ALGORITHM "fstein"
+/* Frame rate never drops below this, however long a frame takes. */
+#define GOV_MIN_FPS 2
+/* Frames come no closer than this many times the time it takes to render and output one. */
+#define GOV_HEADROOM 2
+/* Decisions are made at most this often, on averages of the frames in between. */
+#define GOV_DECIDE_USEC 500000
+/* Content changes fast if server sends at least this many updates a second. */
+#define GOV_BUSY_UPDATES_PER_SEC 4
+/* Content has settled once server has sent no update for this long. */
+#define GOV_SETTLE_USEC 1000000
+/* Frame interval changes only if the new one differs by more than this fraction. */
+#define GOV_INTVL_TOLERANCE 0.2f
+
+/*
+ * Measure render time, terminal output, and the rate at which server updates arrive, and choose the
+ * frame interval and dithering algorithm to hold the input latency target. Frames come as often as
+ * -maxfps allows, but never so often that rendering and output fall behind. The cheap ordered
+ * dither is used while content changes fast (it also changes fewer characters for a small update),
+ * or if a frame takes too long for the target; Floyd-Steinberg is used once content settles.
+ */
+struct gov {
+	bool enabled;
+	long long target_usec, min_intvl, max_intvl;
+	/* The decision in force */
+	long long frame_intvl;
+	const char *algorithm;
+
+	/* Moving averages per frame, and of updates arriving per second */
+	float avg_render_usec, avg_output_usec, avg_output_bytes;
+	float update_rate;
+	int samples;
+	/* Updates arrived and output time since the latest decision */
+	unsigned long window_updates;
+	long long window_start_usec, last_update_usec;
+	unsigned long switches;
+};
+
+/*
+ * Initialise the governor for frame rate cap and the latency target. A disabled governor keeps the
+ * frame rate cap and Floyd-Steinberg dither.
+ */
+void gov_init(struct gov *g, bool enabled, int max_fps, int latency_msec);
+/* Count a frame written to terminal with the bytes of output. Return true only if the decision has changed. */
+bool gov_frame(struct gov *g, struct perf_frame *f, size_t output_bytes);
+/* Switch to the finer dither once content has settled. Return true only if the decision has changed. */
+bool gov_tick(struct gov *g);
+/* Return the milliseconds until gov_tick may change the decision, or -1 if it will not. */
+int gov_due_msec(struct gov *g);
+/* Return the frame rate of the decision in force. */
+int gov_fps(struct gov *g);
+
+#endif
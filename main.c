@@ -2,24 +2,107 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "opt.h"
+#include "pool.h"
 #include "vnc.h"
 #include "viewer.h"
+#include "wall.h"
+
+/* Show several servers as tiles of a wall. Return the exit status. */
+static int main_wall(struct opt *opt, int num_hosts, char **hosts, int argc,
+		     char **argv)
+{
+	struct pool pool;
+	struct wall wall;
+	if (opt->vnc.record_path != NULL || opt->perf_csv != NULL
+	    || opt->snap.path != NULL || opt->vnc.shm_name != NULL
+	    || opt->cast_path != NULL) {
+		fprintf(stderr,
+			"Options -record, -perfcsv, -snapshot, -shm, and -cast take a single server.\n");
+		return 1;
+	}
+	if (!pool_init(&pool, opt->threads)) {
+		fprintf(stderr, "Failed to start render threads.\n");
+		return 1;
+	}
+	if (!wall_init(&wall, opt, &pool, num_hosts, hosts, argc, argv)) {
+		fprintf(stderr, "Failed to initialise the wall of %d servers.\n",
+			num_hosts);
+		return 1;
+	}
+	wall_ev_loop(&wall);
+	wall_terminate(&wall);
+	pool_destroy(&pool);
+	return 0;
+}
+
+/* Render the connected server without terminal. Return the exit status. */
+static int main_snapshot(struct opt *opt, struct vnc *vnc)
+{
+	struct pool pool;
+	/* A snapshot is small, and many of them may run in parallel, one render thread each is enough */
+	if (!pool_init(&pool, (opt->threads > 0) ? opt->threads : 1)) {
+		fprintf(stderr, "Failed to start render threads.\n");
+		return 1;
+	}
+	bool ok = snap_run(&opt->snap, opt, vnc, &pool);
+	pool_destroy(&pool);
+	vnc_destroy(vnc);
+	return ok ? 0 : 1;
+}
 
 int main(int argc, char **argv)
 {
+	struct opt opt;
+	struct pool pool;
 	struct vnc vnc;
 	struct viewer viewer;
-	if (!vnc_init(&vnc, argc, argv)) {
+	if (!opt_parse(&opt, &argc, argv)) {
+		opt_usage(argv[0]);
+		return 1;
+	}
+	char *hosts[WALL_MAX_TILES + 1];
+	int num_hosts = opt_take_hosts(&argc, argv, hosts, WALL_MAX_TILES + 1);
+	if (num_hosts < 0) {
+		opt_usage(argv[0]);
+		return 1;
+	}
+	if (num_hosts > 1) {
+		return main_wall(&opt, num_hosts, hosts, argc, argv);
+	}
+	/* A single server is left to LibVNCClient to pick up */
+	if (num_hosts == 1) {
+		argv[argc++] = hosts[0];
+		argv[argc] = NULL;
+	}
+	if (opt.snap.path != NULL && opt.cast_path != NULL) {
+		fprintf(stderr,
+			"Option -cast records terminal, write the snapshot stream instead.\n");
+		return 1;
+	}
+	/* Without a pointer of its own, a snapshot shows the cursor where server has it */
+	if (opt.snap.path != NULL) {
+		opt.vnc.local_cursor = false;
+	}
+	if (!vnc_init(&vnc, opt.vnc, argc, argv)) {
 		fprintf(stderr,
 			"Failed to establish VNC connection (bad authentication?).\n");
 		return 1;
 	}
-	if (!viewer_init(&viewer, &vnc)) {
+	if (opt.snap.path != NULL) {
+		return main_snapshot(&opt, &vnc);
+	}
+	if (!pool_init(&pool, opt.threads)) {
+		fprintf(stderr, "Failed to start render threads.\n");
+		return 1;
+	}
+	if (!viewer_init(&viewer, &vnc, &opt, &pool)) {
 		fprintf(stderr, "Failed to initialise viewer display.\n");
 		return 1;
 	}
 	viewer_ev_loop(&viewer);
 	viewer_terminate(&viewer);
+	pool_destroy(&pool);
 	vnc_destroy(&vnc);
 	return 0;
 }
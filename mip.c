@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mip.h"
+
+void mip_init(struct mip *m)
+{
+	memset(m, 0, sizeof(struct mip));
+}
+
+bool mip_resize(struct mip *m, int width, int height)
+{
+	if (m->lvls[0].width == width && m->lvls[0].height == height) {
+		return true;
+	}
+	mip_destroy(m);
+	m->lvls[0].width = width;
+	m->lvls[0].height = height;
+	int i;
+	for (i = 1; i <= MIP_MAX_LVL; i++) {
+		struct mip_lvl *l = &m->lvls[i];
+		l->width = (m->lvls[i - 1].width + 1) / 2;
+		l->height = (m->lvls[i - 1].height + 1) / 2;
+		l->pixels = malloc((size_t)l->width * l->height *
+				   sizeof(uint32_t));
+		if (!l->pixels) {
+			mip_destroy(m);
+			return false;
+		}
+	}
+	return true;
+}
+
+int mip_lvl_of(struct mip *m, struct geo_dither_params *params)
+{
+	if (params->width <= 0 || params->height <= 0
+	    || m->lvls[0].width != params->facts.vnc_width
+	    || m->lvls[0].height != params->facts.vnc_height) {
+		return 0;
+	}
+	int px_per_ch_x = params->facts.vnc_width / params->width;
+	int px_per_ch_y = params->facts.vnc_height / params->height;
+	int px_per_ch = (px_per_ch_x < px_per_ch_y) ? px_per_ch_x : px_per_ch_y;
+	int lvl = 0;
+	while (lvl < MIP_MAX_LVL
+	       && px_per_ch >= MIP_MIN_PX_PER_CH << (lvl + 1)) {
+		lvl++;
+	}
+	return lvl;
+}
+
+/*
+ * Reduce the rectangle [x1, x2) [y1, y2) of level from the level below. Each byte lane of the 2x2
+ * pixels is averaged on its own, two lanes at a time, as every channel of snapshot is a byte.
+ * Pixels past the odd edge of level below repeat the edge.
+ */
+static void mip_reduce(struct mip *m, int lvl, int x1, int y1, int x2, int y2)
+{
+	struct mip_lvl *src = &m->lvls[lvl - 1], *dest = &m->lvls[lvl];
+	int x, y;
+	for (y = y1; y < y2; y++) {
+		int sy = y * 2;
+		const uint32_t *row0 = src->pixels + (size_t)sy * src->width;
+		const uint32_t *row1 =
+		    (sy + 1 < src->height) ? row0 + src->width : row0;
+		uint32_t *out = dest->pixels + (size_t)y * dest->width;
+		for (x = x1; x < x2; x++) {
+			int sx0 = x * 2;
+			int sx1 = (sx0 + 1 < src->width) ? sx0 + 1 : sx0;
+			uint32_t a = row0[sx0], b = row0[sx1];
+			uint32_t c = row1[sx0], d = row1[sx1];
+			uint32_t even =
+			    (a & 0x00ff00ff) + (b & 0x00ff00ff) +
+			    (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+			uint32_t odd =
+			    ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+			    ((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff) +
+			    0x00020002;
+			out[x] = ((even >> 2) & 0x00ff00ff) |
+			    ((odd >> 2) & 0x00ff00ff) << 8;
+		}
+	}
+}
+
+/* Reduce the frame-buffer rectangle again on levels [1, lvl]. */
+static void mip_reduce_rect(struct mip *m, struct vnc_rect *r, int lvl)
+{
+	int x1 = r->x < 0 ? 0 : r->x;
+	int y1 = r->y < 0 ? 0 : r->y;
+	int x2 = r->x + r->w, y2 = r->y + r->h;
+	int i;
+	for (i = 1; i <= lvl; i++) {
+		/* The rectangle grows to cover every pixel whose 2x2 pixels below it changed */
+		x1 /= 2;
+		y1 /= 2;
+		x2 = (x2 + 1) / 2;
+		y2 = (y2 + 1) / 2;
+		if (x2 > m->lvls[i].width) {
+			x2 = m->lvls[i].width;
+		}
+		if (y2 > m->lvls[i].height) {
+			y2 = m->lvls[i].height;
+		}
+		if (x2 <= x1 || y2 <= y1) {
+			return;
+		}
+		mip_reduce(m, i, x1, y1, x2, y2);
+	}
+}
+
+void mip_update(struct mip *m, uint32_t * pixels, struct vnc_damage *damage,
+		int lvl)
+{
+	m->lvls[0].pixels = pixels;
+	if (m->lvls[MIP_MAX_LVL].pixels == NULL) {
+		m->num_valid = 0;
+		return;
+	}
+	if (damage->full) {
+		m->num_valid = 0;
+	}
+	/* Levels in use follow the damage, the levels above them are left out of date */
+	int num_follow = (m->num_valid < lvl) ? m->num_valid : lvl;
+	int i;
+	for (i = 0; i < damage->num_rects && !damage->full; i++) {
+		mip_reduce_rect(m, &damage->rects[i], num_follow);
+	}
+	if (damage->full || damage->num_rects > 0) {
+		m->num_valid = num_follow;
+	}
+	for (i = m->num_valid + 1; i <= lvl; i++) {
+		mip_reduce(m, i, 0, 0, m->lvls[i].width, m->lvls[i].height);
+	}
+	if (lvl > m->num_valid) {
+		m->num_valid = lvl;
+	}
+}
+
+void mip_destroy(struct mip *m)
+{
+	int i;
+	for (i = 1; i <= MIP_MAX_LVL; i++) {
+		free(m->lvls[i].pixels);
+	}
+	memset(m, 0, sizeof(struct mip));
+}
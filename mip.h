@@ -0,0 +1,43 @@
+#ifndef MIP_H
+#define MIP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "geo.h"
+#include "vnc.h"
+
+#define MIP_MAX_LVL 6		/* The smallest level is 1/64 of frame-buffer on each axis */
+#define MIP_MIN_PX_PER_CH 2	/* A level is sampled only if a character still covers this many of its pixels */
+
+/* Pixels of a level, each level is half the width and height of the level below, rounded up. */
+struct mip_lvl {
+	uint32_t *pixels;
+	int width, height;
+};
+
+/*
+ * Pyramid of frame-buffer reduced to 1/2, 1/4, 1/8 ... of its size, each pixel being the average
+ * of 2x2 pixels below it. Renderer samples the level nearest to pixels per character, so that the
+ * cost of a zoomed out frame depends on canvas size instead of frame-buffer size.
+ * Level 0 is the frame-buffer itself. Levels above it are brought up to date lazily, and only the
+ * rectangles of frame-buffer that changed are reduced again.
+ */
+struct mip {
+	struct mip_lvl lvls[MIP_MAX_LVL + 1];
+	/* Levels [1, num_valid] are up to date with frame-buffer */
+	int num_valid;
+};
+
+/* Initialise an empty pyramid. */
+void mip_init(struct mip *m);
+/* Make the pyramid fit frame-buffer of the size, levels go out of date if it changes. Return false only on failure. */
+bool mip_resize(struct mip *m, int width, int height);
+/* Return the level whose pixels are nearest to the characters of geometry, without going below MIP_MIN_PX_PER_CH. */
+int mip_lvl_of(struct mip *m, struct geo_dither_params *params);
+/* Bring levels up to and including lvl up to date, given the frame-buffer pixels and their damage since last time. */
+void mip_update(struct mip *m, uint32_t * pixels, struct vnc_damage *damage,
+		int lvl);
+/* Release all levels. */
+void mip_destroy(struct mip *m);
+
+#endif
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "native.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NATIVE_X86_64
+#endif
+
+/* Glyphs in the order of increasing coverage, similar to the ASCII glyphs of libcaca. */
+static const char native_glyphs[NATIVE_NUM_GLYPHS + 1] = " .:;t%SX@8";
+
+/* The 16 ANSI colours in 8-bit RGB, as libcaca renders them. */
+static const uint8_t native_ansi_rgb[16][3] = {
+	{0x00, 0x00, 0x00}, {0x00, 0x00, 0x88}, {0x00, 0x88, 0x00},
+	{0x00, 0x88, 0x88}, {0x88, 0x00, 0x00}, {0x88, 0x00, 0x88},
+	{0x88, 0x88, 0x00}, {0xaa, 0xaa, 0xaa}, {0x44, 0x44, 0x44},
+	{0x44, 0x44, 0xff}, {0x44, 0xff, 0x44}, {0x44, 0xff, 0xff},
+	{0xff, 0x44, 0x44}, {0xff, 0x44, 0xff}, {0xff, 0xff, 0x44},
+	{0xff, 0xff, 0xff}
+};
+
+/* 4x4 Bayer matrix for ordered dithering. */
+static const int native_bayer[4][4] = {
+	{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}
+};
+
+/* A colour approximated by a glyph of foreground colour over background colour. */
+struct native_quant {
+	uint8_t fg, bg;
+	/* Approximate coverage of foreground, 0 - 255 */
+	uint8_t ratio;
+};
+
+/* Quantisation of every 15-bit RGB colour, built once on first use. */
+static struct native_quant native_quant_table[1 << 15];
+static pthread_once_t native_quant_once = PTHREAD_ONCE_INIT;
+
+/* Find the best pair of ANSI colours and coverage for every 15-bit RGB colour. */
+static void native_build_quant_table(void)
+{
+	/* Eyes are most sensitive to green and least sensitive to blue */
+	const float weight[3] = { 3.0f, 6.0f, 1.0f };
+	int c, fg, bg, i;
+	for (c = 0; c < (1 << 15); c++) {
+		float rgb[3];
+		rgb[0] = ((c >> 10) & 31) * 255.0f / 31.0f;
+		rgb[1] = ((c >> 5) & 31) * 255.0f / 31.0f;
+		rgb[2] = (c & 31) * 255.0f / 31.0f;
+		float best_dist = -1.0f;
+		struct native_quant best = { 0, 0, 0 };
+		for (bg = 0; bg < 16; bg++) {
+			for (fg = bg; fg < 16; fg++) {
+				/* Project the colour onto the line between background and foreground */
+				float delta[3], dot = 0.0f, len2 = 0.0f;
+				for (i = 0; i < 3; i++) {
+					delta[i] =
+					    native_ansi_rgb[fg][i] -
+					    native_ansi_rgb[bg][i];
+					dot +=
+					    weight[i] * delta[i] * (rgb[i] -
+								    native_ansi_rgb
+								    [bg][i]);
+					len2 += weight[i] * delta[i] * delta[i];
+				}
+				float t = (len2 > 0.0f) ? dot / len2 : 0.0f;
+				if (t < 0.0f) {
+					t = 0.0f;
+				} else if (t > 1.0f) {
+					t = 1.0f;
+				}
+				float dist = 0.0f;
+				for (i = 0; i < 3; i++) {
+					float diff =
+					    rgb[i] - native_ansi_rgb[bg][i] -
+					    t * delta[i];
+					dist += weight[i] * diff * diff;
+				}
+				if (best_dist < 0.0f || dist < best_dist) {
+					best_dist = dist;
+					best.fg = fg;
+					best.bg = bg;
+					best.ratio = t * 255.0f + 0.5f;
+				}
+			}
+		}
+		native_quant_table[c] = best;
+	}
+}
+
+/* Add up each byte lane of pixels in every span of a row. Portable implementation. */
+static void native_sum_row_scalar(const uint32_t * row,
+				  const struct native_span *spans,
+				  int num_spans, uint32_t * sums)
+{
+	int i, x;
+	for (i = 0; i < num_spans; i++) {
+		uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		for (x = spans[i].start; x < spans[i].end; x++) {
+			uint32_t px = row[x];
+			s0 += px & 0xff;
+			s1 += (px >> 8) & 0xff;
+			s2 += (px >> 16) & 0xff;
+			s3 += px >> 24;
+		}
+		sums[i * 4] += s0;
+		sums[i * 4 + 1] += s1;
+		sums[i * 4 + 2] += s2;
+		sums[i * 4 + 3] += s3;
+	}
+}
+
+#ifdef NATIVE_X86_64
+/* Add up each byte lane of pixels in every span of a row, 4 pixels at a time. */
+static void native_sum_row_sse2(const uint32_t * row,
+				const struct native_span *spans,
+				int num_spans, uint32_t * sums)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i;
+	for (i = 0; i < num_spans; i++) {
+		int x = spans[i].start, end = spans[i].end;
+		__m128i acc32 = zero;
+		while (x + 4 <= end) {
+			/* 16-bit lanes take 2 pixels per iteration, flush them before overflow. */
+			__m128i acc16 = zero;
+			int stop = x + 4 * 64;
+			for (; x + 4 <= end && x < stop; x += 4) {
+				__m128i px =
+				    _mm_loadu_si128((const __m128i *)(row + x));
+				acc16 =
+				    _mm_add_epi16(acc16,
+						  _mm_unpacklo_epi8(px, zero));
+				acc16 =
+				    _mm_add_epi16(acc16,
+						  _mm_unpackhi_epi8(px, zero));
+			}
+			acc32 =
+			    _mm_add_epi32(acc32,
+					  _mm_add_epi32(_mm_unpacklo_epi16
+							(acc16, zero),
+							_mm_unpackhi_epi16
+							(acc16, zero)));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *) lanes, acc32);
+		for (; x < end; x++) {
+			uint32_t px = row[x];
+			lanes[0] += px & 0xff;
+			lanes[1] += (px >> 8) & 0xff;
+			lanes[2] += (px >> 16) & 0xff;
+			lanes[3] += px >> 24;
+		}
+		sums[i * 4] += lanes[0];
+		sums[i * 4 + 1] += lanes[1];
+		sums[i * 4 + 2] += lanes[2];
+		sums[i * 4 + 3] += lanes[3];
+	}
+}
+
+/* Add up each byte lane of pixels in every span of a row, 8 pixels at a time. */
+__attribute__ ((target("avx2")))
+static void native_sum_row_avx2(const uint32_t * row,
+				const struct native_span *spans,
+				int num_spans, uint32_t * sums)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int i;
+	for (i = 0; i < num_spans; i++) {
+		int x = spans[i].start, end = spans[i].end;
+		__m256i acc32 = zero;
+		while (x + 8 <= end) {
+			/* 16-bit lanes take 2 pixels per iteration, flush them before overflow. */
+			__m256i acc16 = zero;
+			int stop = x + 8 * 64;
+			for (; x + 8 <= end && x < stop; x += 8) {
+				__m256i px =
+				    _mm256_loadu_si256((const __m256i *)(row +
+									 x));
+				acc16 =
+				    _mm256_add_epi16(acc16,
+						     _mm256_unpacklo_epi8(px,
+									  zero));
+				acc16 =
+				    _mm256_add_epi16(acc16,
+						     _mm256_unpackhi_epi8(px,
+									  zero));
+			}
+			acc32 =
+			    _mm256_add_epi32(acc32,
+					     _mm256_add_epi32
+					     (_mm256_unpacklo_epi16(acc16, zero),
+					      _mm256_unpackhi_epi16(acc16,
+								    zero)));
+		}
+		__m128i acc =
+		    _mm_add_epi32(_mm256_castsi256_si128(acc32),
+				  _mm256_extracti128_si256(acc32, 1));
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *) lanes, acc);
+		for (; x < end; x++) {
+			uint32_t px = row[x];
+			lanes[0] += px & 0xff;
+			lanes[1] += (px >> 8) & 0xff;
+			lanes[2] += (px >> 16) & 0xff;
+			lanes[3] += px >> 24;
+		}
+		sums[i * 4] += lanes[0];
+		sums[i * 4 + 1] += lanes[1];
+		sums[i * 4 + 2] += lanes[2];
+		sums[i * 4 + 3] += lanes[3];
+	}
+}
+#endif
+
+/* The fastest row summing function supported by CPU. */
+static void (*native_sum_row)(const uint32_t *, const struct native_span *,
+			      int, uint32_t *) = native_sum_row_scalar;
+
+bool native_init(struct native *n, struct pool *pool)
+{
+	memset(n, 0, sizeof(struct native));
+	n->pool = pool;
+#ifdef NATIVE_X86_64
+	native_sum_row = native_sum_row_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		native_sum_row = native_sum_row_avx2;
+	}
+#endif
+	pthread_once(&native_quant_once, native_build_quant_table);
+	/* Remember the caca attribute of every pair of ANSI colours */
+	caca_canvas_t *canvas = caca_create_canvas(0, 0);
+	if (!canvas) {
+		fprintf(stderr, "Failed to create caca canvas\n");
+		return false;
+	}
+	int fg, bg;
+	for (fg = 0; fg < 16; fg++) {
+		for (bg = 0; bg < 16; bg++) {
+			caca_set_color_ansi(canvas, fg, bg);
+			n->attrs[fg][bg] = caca_get_attr(canvas, -1, -1);
+		}
+	}
+	caca_free_canvas(canvas);
+	native_set_format(n, 0x000000ff, 0x0000ff00, 0x00ff0000, "fstein",
+			  false);
+	return true;
+}
+
+/* Return the byte lane of a colour channel mask, or -1 if the mask does not occupy exactly one byte. */
+static int native_lane_of(uint32_t mask)
+{
+	int lane;
+	for (lane = 0; lane < 4; lane++) {
+		if (mask == (uint32_t)0xff << (lane * 8)) {
+			return lane;
+		}
+	}
+	return -1;
+}
+
+bool native_supports(int bpp, uint32_t rmask, uint32_t gmask, uint32_t bmask)
+{
+	return bpp == 32 && native_lane_of(rmask) != -1
+	    && native_lane_of(gmask) != -1 && native_lane_of(bmask) != -1;
+}
+
+void native_set_format(struct native *n, uint32_t rmask, uint32_t gmask,
+		       uint32_t bmask, const char *algorithm, bool half_block)
+{
+	n->lane_r = native_lane_of(rmask);
+	n->lane_g = native_lane_of(gmask);
+	n->lane_b = native_lane_of(bmask);
+	n->half_block = half_block;
+	if (half_block) {
+		/* 12-bit colours are dithered by the ordered matrix, they are too fine for error diffusion to pay off */
+		n->fstein = false;
+		n->ordered = strcmp(algorithm, "none") != 0;
+	} else {
+		n->fstein = strcmp(algorithm, "fstein") == 0;
+		n->ordered = strncmp(algorithm, "ordered", 7) == 0;
+	}
+}
+
+/* Return the pixels covered by a character, given the character position relative to image. */
+static struct native_span native_span_of(int rel_ch, int num_ch, int num_px)
+{
+	struct native_span span;
+	span.start = (int64_t) rel_ch *num_px / num_ch;
+	span.end = (int64_t) (rel_ch + 1) * num_px / num_ch;
+	/* When zoomed in far enough, several characters share one pixel */
+	if (span.start > num_px - 1) {
+		span.start = num_px - 1;
+	}
+	if (span.end <= span.start) {
+		span.end = span.start + 1;
+	}
+	return span;
+}
+
+/* Calculate pixel spans of characters, if geometry has changed. Return false only on failure. */
+static bool native_calc_spans(struct native *n,
+			      struct geo_dither_params *params)
+{
+	if (n->cols != NULL && memcmp(params, &n->params, sizeof(*params)) == 0) {
+		return true;
+	}
+	int ch_width = params->facts.ch_width;
+	int ch_height = params->facts.ch_height;
+	if (ch_width > n->cols_cap) {
+		free(n->cols);
+		n->cols = malloc(ch_width * sizeof(struct native_span));
+		if (!n->cols) {
+			n->cols_cap = 0;
+			return false;
+		}
+		n->cols_cap = ch_width;
+	}
+	if (ch_height > n->rows_cap) {
+		free(n->rows);
+		n->rows = malloc(ch_height * sizeof(struct native_span));
+		if (!n->rows) {
+			n->rows_cap = 0;
+			return false;
+		}
+		n->rows_cap = ch_height;
+	}
+	if (ch_width * ch_height > n->cells_cap) {
+		free(n->cells);
+		n->cells =
+		    malloc(ch_width * ch_height * sizeof(struct native_cell));
+		if (!n->cells) {
+			n->cells_cap = 0;
+			return false;
+		}
+		n->cells_cap = ch_width * ch_height;
+	}
+	int i;
+	for (i = 0; i < ch_width; i++) {
+		n->cols[i] =
+		    native_span_of(i - params->x, params->width,
+				   params->facts.vnc_width);
+	}
+	for (i = 0; i < ch_height; i++) {
+		n->rows[i] =
+		    native_span_of(i - params->y, params->height,
+				   params->facts.vnc_height);
+	}
+	n->params = *params;
+	return true;
+}
+
+/* Make sure the worker has enough scratch memory for a row of characters. Return false only on failure. */
+static bool native_worker_alloc(struct native_worker *w, int width)
+{
+	if (width <= w->cap) {
+		return true;
+	}
+	free(w->sums);
+	free(w->lower_sums);
+	free(w->err_cur);
+	free(w->err_next);
+	w->sums = malloc(width * 4 * sizeof(uint32_t));
+	w->lower_sums = malloc(width * 4 * sizeof(uint32_t));
+	w->err_cur = malloc((width + 2) * sizeof(int));
+	w->err_next = malloc((width + 2) * sizeof(int));
+	if (!w->sums || !w->lower_sums || !w->err_cur || !w->err_next) {
+		w->cap = 0;
+		return false;
+	}
+	w->cap = width;
+	return true;
+}
+
+/* Turn the colour sums of a row of characters into glyphs and colours. Cells may be NULL to only diffuse error. */
+static void native_quantise_row(struct native *n, struct native_worker *w,
+				int y, struct native_cell *cells)
+{
+	int width = n->x2 - n->x1;
+	int span_h = n->rows[y].end - n->rows[y].start;
+	int i;
+	for (i = 0; i < width; i++) {
+		int x = n->x1 + i;
+		struct native_span *col = &n->cols[x];
+		uint32_t area = (col->end - col->start) * span_h;
+		uint32_t *sum = &w->sums[i * 4];
+		uint32_t r = sum[n->lane_r] / area;
+		uint32_t g = sum[n->lane_g] / area;
+		uint32_t b = sum[n->lane_b] / area;
+		struct native_quant q =
+		    native_quant_table[(r >> 3) << 10 | (g >> 3) << 5 | (b >>
+									 3)];
+		/* Coverage is scaled to 255 units per glyph */
+		int val = q.ratio * (NATIVE_NUM_GLYPHS - 1);
+		if (n->fstein) {
+			val += w->err_cur[i + 1] / 16;
+		} else if (n->ordered) {
+			val += native_bayer[y & 3][x & 3] * 255 / 16 - 127;
+		}
+		int glyph = (val < 0) ? 0 : (val + 127) / 255;
+		if (glyph > NATIVE_NUM_GLYPHS - 1) {
+			glyph = NATIVE_NUM_GLYPHS - 1;
+		}
+		if (n->fstein) {
+			/* Diffuse the error (in 1/16) to the right and to the next row */
+			int e = val - glyph * 255;
+			w->err_cur[i + 2] += e * 7;
+			w->err_next[i] += e * 3;
+			w->err_next[i + 1] += e * 5;
+			w->err_next[i + 2] += e;
+		}
+		if (cells != NULL) {
+			cells[i].glyph = glyph;
+			cells[i].fg = q.fg;
+			cells[i].bg = q.bg;
+		}
+	}
+}
+
+/* Return the 4-bit level of an 8-bit channel, dithered by threshold (0 - 254). */
+static inline uint16_t native_rgb4_of(uint32_t channel, int threshold)
+{
+	uint32_t level = (channel * 15 + threshold) / 255;
+	return (level > 15) ? 15 : level;
+}
+
+/* Return the 12-bit RGB colour of the byte lane sums of an area, dithered at the sub-pixel position. */
+static uint16_t native_rgb12_of(struct native *n, const uint32_t * sum,
+				uint32_t area, int x, int sub_y)
+{
+	int threshold = 127;
+	if (n->ordered) {
+		threshold = native_bayer[sub_y & 3][x & 3] * 255 / 16 + 8;
+	}
+	return native_rgb4_of(sum[n->lane_r] / area, threshold) << 8 |
+	    native_rgb4_of(sum[n->lane_g] / area, threshold) << 4 |
+	    native_rgb4_of(sum[n->lane_b] / area, threshold);
+}
+
+/* Turn the colour sums of the upper and lower half of a row of characters into half blocks. */
+static void native_quantise_row_half_block(struct native *n,
+					   struct native_worker *w, int y,
+					   int upper_h, int lower_h,
+					   struct native_cell *cells)
+{
+	int width = n->x2 - n->x1;
+	int i;
+	for (i = 0; i < width; i++) {
+		int x = n->x1 + i;
+		struct native_span *col = &n->cols[x];
+		uint32_t col_w = col->end - col->start;
+		cells[i].glyph = 0;
+		cells[i].fg =
+		    native_rgb12_of(n, &w->sums[i * 4], col_w * upper_h, x,
+				    y * 2);
+		cells[i].bg =
+		    native_rgb12_of(n, &w->lower_sums[i * 4], col_w * lower_h,
+				    x, y * 2 + 1);
+	}
+}
+
+/* Sum up the upper and lower half of a row of characters, and turn them into half blocks. */
+static void native_render_half_block_row(struct native *n,
+					 struct native_worker *w, int y,
+					 struct native_cell *cells)
+{
+	int width = n->x2 - n->x1;
+	int start = n->rows[y].start, end = n->rows[y].end;
+	int mid = (start + end + 1) / 2;
+	int py;
+	memset(w->sums, 0, width * 4 * sizeof(uint32_t));
+	memset(w->lower_sums, 0, width * 4 * sizeof(uint32_t));
+	for (py = start; py < end; py++) {
+		const uint32_t *row =
+		    (const uint32_t *)((const uint8_t *)n->pixels +
+				       (size_t)py * n->pitch);
+		native_sum_row(row, n->cols + n->x1, width,
+			       (py < mid) ? w->sums : w->lower_sums);
+	}
+	if (mid == end) {
+		/* When zoomed in far enough, one pixel makes both halves */
+		memcpy(w->lower_sums, w->sums, width * 4 * sizeof(uint32_t));
+		native_quantise_row_half_block(n, w, y, mid - start,
+					       mid - start, cells);
+		return;
+	}
+	native_quantise_row_half_block(n, w, y, mid - start, end - mid, cells);
+}
+
+/* Render a band of character rows into cells. Run by pool threads. */
+static void native_render_band(void *struct_native, int band, int thread)
+{
+	struct native *n = (struct native *)struct_native;
+	struct native_worker *w = &n->workers[thread];
+	int width = n->x2 - n->x1;
+	int band_y1 = n->y1 + band * n->band_rows;
+	int band_y2 = band_y1 + n->band_rows;
+	if (band_y2 > n->y2) {
+		band_y2 = n->y2;
+	}
+	/*
+	 * Error diffusion runs from top to bottom. A band below the first starts
+	 * with a few rows of the band above to seed its error, so that the seam
+	 * between bands does not stand out.
+	 */
+	int y = band_y1;
+	if (n->fstein) {
+		y -= NATIVE_SEED_ROWS;
+		if (y < n->y1) {
+			y = n->y1;
+		}
+	}
+	memset(w->err_cur, 0, (width + 2) * sizeof(int));
+	memset(w->err_next, 0, (width + 2) * sizeof(int));
+	for (; y < band_y2; y++) {
+		int py;
+		if (n->half_block) {
+			native_render_half_block_row(n, w, y,
+						     &n->cells[(y - n->y1) *
+							       width]);
+			continue;
+		}
+		memset(w->sums, 0, width * 4 * sizeof(uint32_t));
+		for (py = n->rows[y].start; py < n->rows[y].end; py++) {
+			const uint32_t *row =
+			    (const uint32_t *)((const uint8_t *)n->pixels +
+					       (size_t)py * n->pitch);
+			native_sum_row(row, n->cols + n->x1, width, w->sums);
+		}
+		struct native_cell *cells = NULL;
+		if (y >= band_y1) {
+			cells = &n->cells[(y - n->y1) * width];
+		}
+		native_quantise_row(n, w, y, cells);
+		int *tmp = w->err_cur;
+		w->err_cur = w->err_next;
+		w->err_next = tmp;
+		memset(w->err_next, 0, (width + 2) * sizeof(int));
+	}
+}
+
+void native_render(struct native *n, caca_canvas_t * canvas,
+		   struct geo_dither_params *params, struct geo_rect rect,
+		   const uint32_t * pixels, int pitch)
+{
+	/* Only draw the characters covered by both canvas and image */
+	int x1 = rect.x, y1 = rect.y;
+	int x2 = rect.x + rect.width, y2 = rect.y + rect.height;
+	if (x1 < 0) {
+		x1 = 0;
+	}
+	if (x1 < params->x) {
+		x1 = params->x;
+	}
+	if (y1 < 0) {
+		y1 = 0;
+	}
+	if (y1 < params->y) {
+		y1 = params->y;
+	}
+	if (x2 > params->facts.ch_width) {
+		x2 = params->facts.ch_width;
+	}
+	if (x2 > params->x + params->width) {
+		x2 = params->x + params->width;
+	}
+	if (y2 > params->facts.ch_height) {
+		y2 = params->facts.ch_height;
+	}
+	if (y2 > params->y + params->height) {
+		y2 = params->y + params->height;
+	}
+	if (x2 <= x1 || y2 <= y1 || params->facts.vnc_width <= 0
+	    || params->facts.vnc_height <= 0) {
+		return;
+	}
+	int num_threads = (n->pool != NULL) ? n->pool->num_threads : 1;
+	int i;
+	bool alloc_ok = native_calc_spans(n, params);
+	for (i = 0; i < num_threads; i++) {
+		alloc_ok = alloc_ok && native_worker_alloc(&n->workers[i],
+							   x2 - x1);
+	}
+	if (!alloc_ok) {
+		fprintf(stderr, "Failed to allocate native renderer memory\n");
+		return;
+	}
+	n->x1 = x1;
+	n->y1 = y1;
+	n->x2 = x2;
+	n->y2 = y2;
+	n->pixels = pixels;
+	n->pitch = pitch;
+	/* One band per thread keeps the number of seams, hence seeding overhead, low */
+	int num_bands = num_threads;
+	if ((y2 - y1) / num_bands < NATIVE_MIN_BAND_ROWS) {
+		num_bands = (y2 - y1) / NATIVE_MIN_BAND_ROWS;
+	}
+	if (num_bands < 1) {
+		num_bands = 1;
+	}
+	n->band_rows = (y2 - y1 + num_bands - 1) / num_bands;
+	if (n->pool != NULL) {
+		pool_run(n->pool, native_render_band, n, num_bands);
+	} else {
+		native_render_band(n, 0, 0);
+	}
+	/* Canvas is not thread safe, hence it is only touched here. */
+	int x, y;
+	struct native_cell *cell = n->cells;
+	if (n->half_block) {
+		for (y = y1; y < y2; y++) {
+			for (x = x1; x < x2; x++, cell++) {
+				caca_set_color_argb(canvas, 0xf000 | cell->fg,
+						    0xf000 | cell->bg);
+				caca_put_char(canvas, x, y, NATIVE_HALF_BLOCK);
+			}
+		}
+		return;
+	}
+	for (y = y1; y < y2; y++) {
+		for (x = x1; x < x2; x++, cell++) {
+			caca_put_char(canvas, x, y, native_glyphs[cell->glyph]);
+			caca_put_attr(canvas, x, y,
+				      n->attrs[cell->fg][cell->bg]);
+		}
+	}
+}
+
+void native_destroy(struct native *n)
+{
+	int i;
+	for (i = 0; i < POOL_MAX_THREADS; i++) {
+		free(n->workers[i].sums);
+		free(n->workers[i].lower_sums);
+		free(n->workers[i].err_cur);
+		free(n->workers[i].err_next);
+	}
+	free(n->cols);
+	free(n->rows);
+	free(n->cells);
+	memset(n, 0, sizeof(struct native));
+}
@@ -0,0 +1,79 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "geo.h"
+#include "pool.h"
+
+#define NATIVE_NUM_GLYPHS 10
+/* Upper half block, its foreground colour paints the upper half of character and background paints the lower. */
+#define NATIVE_HALF_BLOCK 0x2580
+/* Each band of characters starts dithering this many rows early, to carry over error diffusion from the band above. */
+#define NATIVE_SEED_ROWS 2
+/* Bands shorter than this many rows are not worth the overhead of going parallel. */
+#define NATIVE_MIN_BAND_ROWS 4
+
+/* Range of frame-buffer pixels [start, end) covered by a character column or row. */
+struct native_span {
+	int start, end;
+};
+
+/* Scratch memory of a thread rendering a band of characters. */
+struct native_worker {
+	/* Sum of each byte lane of pixels in a row of characters, 4 lanes per character */
+	uint32_t *sums;
+	/* Sums of the lower half of characters, used only by half blocks */
+	uint32_t *lower_sums;
+	/* Floyd-Steinberg error of this row and the next row of characters, offset by one */
+	int *err_cur, *err_next;
+	int cap;
+};
+
+/* Glyph and colours chosen for a character, colours are ANSI colours or 12-bit RGB of half blocks. */
+struct native_cell {
+	uint8_t glyph;
+	uint16_t fg, bg;
+};
+
+/*
+ * Built-in renderer for 32-bit frame-buffers. It box-filters the pixels down to one colour per character,
+ * then quantises the colour into a pair of ANSI colours and a glyph, dithered on the small character grid.
+ * In half block mode, it box-filters the upper and lower half of character into two 12-bit RGB colours instead.
+ */
+struct native {
+	/* Pixel spans of each character column and row, calculated for the latest geometry */
+	struct geo_dither_params params;
+	struct native_span *cols, *rows;
+	int cols_cap, rows_cap;
+	/* Bands of characters are rendered in parallel into the cells, then copied onto canvas */
+	struct pool *pool;
+	struct native_worker workers[POOL_MAX_THREADS];
+	struct native_cell *cells;
+	int cells_cap;
+	/* The rectangle [x1, x2) [y1, y2) of characters being rendered, and its pixels */
+	int x1, y1, x2, y2, band_rows;
+	const uint32_t *pixels;
+	int pitch;
+	/* Byte lanes that carry red, green, and blue in a pixel */
+	int lane_r, lane_g, lane_b;
+	bool fstein, ordered, half_block;
+	uint32_t attrs[16][16];
+};
+
+/* Initialise the renderer, it renders in parallel on the pool threads. Return false only on failure. */
+bool native_init(struct native *n, struct pool *pool);
+/* Return true only if the renderer understands the pixel format, see struct render_fb. */
+bool native_supports(int bpp, uint32_t rmask, uint32_t gmask, uint32_t bmask);
+/* Set pixel format, dithering algorithm (as understood by libcaca), and half block mode for the following frames. */
+void native_set_format(struct native *n, uint32_t rmask, uint32_t gmask,
+		       uint32_t bmask, const char *algorithm, bool half_block);
+/* Render the rectangle of characters from 32-bit pixels, leave the rest of canvas alone. */
+void native_render(struct native *n, caca_canvas_t * canvas,
+		   struct geo_dither_params *params, struct geo_rect rect,
+		   const uint32_t * pixels, int pitch);
+/* Release all resources held by the renderer. */
+void native_destroy(struct native *n);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opt.h"
+#include "viewer.h"
+
+/* Remove num arguments from command line, starting at index i. */
+static void opt_purge(int *argc, char **argv, int i, int num)
+{
+	/* Also move the NULL that terminates argument list */
+	memmove(argv + i, argv + i + num,
+		(*argc - i - num + 1) * sizeof(char *));
+	*argc -= num;
+}
+
+/* Return true only if argument i is the option name and it comes with a value. */
+static bool opt_is(int argc, char **argv, int i, const char *name)
+{
+	return i + 1 < argc && strcmp(argv[i], name) == 0;
+}
+
+/* Parse the value of option as one of the choices, store its index. Return false only if it is invalid. */
+static bool opt_choice(const char *name, const char *val,
+		       const char *const *choices, int *dest)
+{
+	int i;
+	for (i = 0; choices[i] != NULL; i++) {
+		if (strcmp(val, choices[i]) == 0) {
+			*dest = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Option %s takes one of:", name);
+	for (i = 0; choices[i] != NULL; i++) {
+		fprintf(stderr, " %s", choices[i]);
+	}
+	fprintf(stderr, "\n");
+	return false;
+}
+
+/* Parse the integer value of option within the range. Return false only if it is invalid. */
+static bool opt_int(const char *name, const char *val, int min, int max,
+		    int *dest)
+{
+	char *end;
+	long num = strtol(val, &end, 10);
+	if (*val == '\0' || *end != '\0' || num < min || num > max) {
+		fprintf(stderr, "Option %s takes a number between %d and %d\n",
+			name, min, max);
+		return false;
+	}
+	*dest = (int)num;
+	return true;
+}
+
+/* Names of render modes, in the order of enum render_mode. */
+static const char *const opt_render_modes[] =
+    { "native", "caca", "halfblock", NULL };
+
+/* Names of terminal outputs, in the order of enum term_output. */
+static const char *const opt_outputs[] = { "ncurses", "native", NULL };
+
+/* Parse the value of option as width x height, each within the range. Return false only if it is invalid. */
+static bool opt_size(const char *name, const char *val, int min, int max,
+		     int *width, int *height)
+{
+	char *end;
+	long w = strtol(val, &end, 10);
+	if (end != val && *end == 'x') {
+		const char *h_val = end + 1;
+		long h = strtol(h_val, &end, 10);
+		if (end != h_val && *end == '\0' && w >= min && w <= max
+		    && h >= min && h <= max) {
+			*width = (int)w;
+			*height = (int)h;
+			return true;
+		}
+	}
+	fprintf(stderr, "Option %s takes WxH, each between %d and %d\n", name,
+		min, max);
+	return false;
+}
+
+/* Names of headless output formats, in the order of enum snap_format. */
+static const char *const opt_snap_formats[] = { "ansi", "text", NULL };
+
+/* Names of pixel depths, in the order of enum vnc_depth. */
+static const char *const opt_depths[] = { "32", "16", "8", NULL };
+
+/* Names of switches, false comes first. */
+static const char *const opt_switches[] = { "off", "on", NULL };
+
+/* Names of encoding tunings, in the order of enum tune_mode. */
+static const char *const opt_tunings[] = { "off", "lan", "wan", "auto", NULL };
+
+/* Names of terminal colours, in the order of enum term_colours. */
+static const char *const opt_colours[] =
+    { "auto", "16", "256", "truecolor", NULL };
+
+bool opt_parse(struct opt *o, int *argc, char **argv)
+{
+	memset(o, 0, sizeof(struct opt));
+	o->max_fps = VIEWER_DEFAULT_MAX_FPS;
+	o->governor = true;
+	o->latency_msec = GOV_DEFAULT_LATENCY_MSEC;
+	o->render_mode = RENDER_NATIVE;
+	o->vnc.server_scale = true;
+	o->vnc.local_cursor = true;
+	o->display_driver = "ncurses";
+	o->snap.width = SNAP_DEFAULT_WIDTH;
+	o->snap.height = SNAP_DEFAULT_HEIGHT;
+	int i = 1, choice;
+	bool output_given = false;
+	while (i < *argc) {
+		if (opt_is(*argc, argv, i, "-maxfps")) {
+			if (!opt_int(argv[i], argv[i + 1], 1, 1000,
+				     &o->max_fps)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-governor")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_switches,
+					&choice)) {
+				return false;
+			}
+			o->governor = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-latency")) {
+			if (!opt_int(argv[i], argv[i + 1], 1, 10000,
+				     &o->latency_msec)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-renderer")) {
+			if (!opt_choice(argv[i], argv[i + 1],
+					opt_render_modes, &choice)) {
+				return false;
+			}
+			o->render_mode = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-output")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_outputs,
+					&choice)) {
+				return false;
+			}
+			o->output = choice;
+			output_given = true;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-colours")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_colours,
+					&choice)) {
+				return false;
+			}
+			o->colours = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-depth")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_depths,
+					&choice)) {
+				return false;
+			}
+			o->vnc.depth = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-serverscale")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_switches,
+					&choice)) {
+				return false;
+			}
+			o->vnc.server_scale = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-localcursor")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_switches,
+					&choice)) {
+				return false;
+			}
+			o->vnc.local_cursor = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-tuning")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_tunings,
+					&choice)) {
+				return false;
+			}
+			o->vnc.tuning = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-perfcsv")) {
+			o->perf_csv = argv[i + 1];
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-record")) {
+			o->vnc.record_path = argv[i + 1];
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-cast")) {
+			o->cast_path = argv[i + 1];
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-shm")) {
+			o->vnc.shm_name = argv[i + 1];
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-snapshot")) {
+			o->snap.path = argv[i + 1];
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-size")) {
+			if (!opt_size(argv[i], argv[i + 1], 1, 10000,
+				      &o->snap.width, &o->snap.height)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-format")) {
+			if (!opt_choice(argv[i], argv[i + 1], opt_snap_formats,
+					&choice)) {
+				return false;
+			}
+			o->snap.format = choice;
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-interval")) {
+			if (!opt_int(argv[i], argv[i + 1], 0, 3600000,
+				     &o->snap.interval_msec)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-count")) {
+			if (!opt_int(argv[i], argv[i + 1], 0, 1000000000,
+				     &o->snap.count)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else if (opt_is(*argc, argv, i, "-threads")) {
+			if (!opt_int(argv[i], argv[i + 1], 0, POOL_MAX_THREADS,
+				     &o->threads)) {
+				return false;
+			}
+			opt_purge(argc, argv, i, 2);
+		} else {
+			i++;
+		}
+	}
+	/* Colours beyond the 16 of ncurses driver reach terminal only through native output */
+	bool rich_colours = o->render_mode == RENDER_HALF_BLOCK
+	    || o->colours == TERM_COLOURS_256 || o->colours == TERM_COLOURS_TRUE;
+	if (rich_colours && !output_given) {
+		o->output = TERM_OUTPUT_NATIVE;
+	} else if (rich_colours && o->output == TERM_OUTPUT_NCURSES) {
+		fprintf(stderr,
+			"Warning: -output ncurses shows 16 colours, -renderer halfblock and -colours need -output native\n");
+	}
+	/* Automatic tuning would replace the encodings asked for on its first switch */
+	for (i = 1; i < *argc && o->vnc.tuning == TUNE_AUTO; i++) {
+		if (strcmp(argv[i], "-encodings") == 0
+		    || strcmp(argv[i], "-compress") == 0
+		    || strcmp(argv[i], "-quality") == 0) {
+			fprintf(stderr,
+				"Option %s cannot be used with -tuning auto, which chooses encodings itself\n",
+				argv[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Options of LibVNCClient that come with a value, and those that come without. */
+static const char *const opt_vnc_valued[] =
+    { "-encodings", "-compress", "-quality", "-scale", "-qosdscp",
+	"-repeaterdest", NULL
+};
+
+static const char *const opt_vnc_flags[] =
+    { "-listen", "-listennofork", "-play", NULL };
+
+/* Return true only if the name is in the list. */
+static bool opt_in(const char *const *names, const char *name)
+{
+	int i;
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(names[i], name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int opt_take_hosts(int *argc, char **argv, char **hosts, int max_hosts)
+{
+	int i = 1, num_hosts = 0;
+	while (i < *argc) {
+		/* Guessing whether an unknown option takes a value could turn the value into a server */
+		if (opt_in(opt_vnc_valued, argv[i])) {
+			i += 2;
+		} else if (opt_in(opt_vnc_flags, argv[i])) {
+			i++;
+		} else if (argv[i][0] == '-') {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return -1;
+		} else if (num_hosts < max_hosts) {
+			hosts[num_hosts++] = argv[i];
+			opt_purge(argc, argv, i, 1);
+		} else {
+			/* Leave the excess to LibVNCClient, whose last host wins */
+			i++;
+		}
+	}
+	return num_hosts;
+}
+
+void opt_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] host_or_ip:port [host_or_ip:port ...]\n"
+		"  -maxfps N    Redraw terminal at most N times a second (default %d)\n"
+		"  -governor S  on (default) adapts frame rate and dithering to the latency target, or off\n"
+		"  -latency MS  Latency target of the governor in milliseconds (default %d)\n"
+		"  -renderer R  native (default, falls back to caca if unsupported), caca, or halfblock\n"
+		"  -depth D     Ask server for 32 (default), 16 (RGB565), or 8 (BGR233) bits per pixel\n"
+		"  -serverscale S  on (default) asks server to scale frame-buffer down when zoomed out, or off\n"
+		"  -localcursor S  on (default) draws the cursor shape sent by server locally, off leaves it to server\n"
+		"  -tuning T    Encodings: off (default, up to LibVNCClient), lan, wan, or auto\n"
+		"  -perfcsv F   Write performance counters of every frame to CSV file F\n"
+		"  -record F    Record what server sends into file F, for replaying with headmore-replay\n"
+		"  -cast F      Record what terminal shows into file F, for converting with headmore-asciicast\n"
+		"  -shm NAME    Share frame-buffer with local tools in POSIX shared memory NAME (e.g. /headmore)\n"
+		"  -threads N   Render on N threads, 0 means one per CPU (default 0)\n"
+		"  -output O    ncurses (default, native with halfblock or -colours 256|truecolor) or native\n"
+		"  -colours C   Colours of native output: auto (default), 16, 256, or truecolor\n"
+		"  -snapshot F  Without terminal, render the first update into file F (- for standard output) and quit\n"
+		"  -size WxH    Size of snapshot in characters (default %dx%d)\n"
+		"  -format F    Snapshot as ansi (default, UTF-8 with colours) or text (UTF-8 without colours)\n"
+		"  -interval MS Stream a snapshot every MS milliseconds instead of quitting after the first\n"
+		"  -count N     Stop streaming after N snapshots (default 0, until connection is lost)\n"
+		"LibVNCClient options -encodings, -compress, -quality, -scale, -qosdscp, -repeaterdest,\n"
+		"-listen, -listennofork, and -play are also accepted.\n"
+		"Several servers are shown as tiles of a wall, Tab moves keyboard focus to the next tile.\n",
+		prog, VIEWER_DEFAULT_MAX_FPS, GOV_DEFAULT_LATENCY_MSEC,
+		SNAP_DEFAULT_WIDTH,
+		SNAP_DEFAULT_HEIGHT);
+}
@@ -0,0 +1,40 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include <stdbool.h>
+#include "render.h"
+#include "snap.h"
+#include "term.h"
+
+/* Command line options understood by headmore itself. The remaining ones are left to LibVNCClient. */
+struct opt {
+	int max_fps;
+	/* Adapt frame rate and dithering to the input latency target, see struct gov */
+	bool governor;
+	int latency_msec;
+	enum render_mode render_mode;
+	int threads;
+	enum term_output output;
+	enum term_colours colours;
+	struct vnc_settings vnc;
+	/* Write performance counters of every frame to this CSV file, NULL if not wanted */
+	const char *perf_csv;
+	/* Record the frames shown on terminal into this cast file, NULL if not wanted */
+	const char *cast_path;
+	/* Display driver of libcaca, ncurses unless rendering without a terminal (e.g. "null") */
+	const char *display_driver;
+	/* Render without terminal and write frames out, see snap_run */
+	struct snap_settings snap;
+};
+
+/* Parse headmore options and remove them from command line. Return false only if an option is invalid. */
+bool opt_parse(struct opt *o, int *argc, char **argv);
+/*
+ * Move the servers (arguments other than options) from command line into hosts, the options left must
+ * be ones of LibVNCClient. Return the number of servers, or -1 if an option is unknown.
+ */
+int opt_take_hosts(int *argc, char **argv, char **hosts, int max_hosts);
+/* Print command line usage to standard error. */
+void opt_usage(const char *prog);
+
+#endif
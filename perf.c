@@ -0,0 +1,142 @@
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
+#include "perf.h"
+
+long long perf_clock_usec(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long perf_now_usec(void)
+{
+	return perf_clock_usec(CLOCK_MONOTONIC);
+}
+
+bool perf_socket_bytes(int fd, unsigned long long *bytes)
+{
+#ifdef __linux__
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+		return false;
+	}
+	/* Older kernels do not count bytes */
+	if (len < offsetof(struct tcp_info, tcpi_bytes_received) +
+	    sizeof(info.tcpi_bytes_received)) {
+		return false;
+	}
+	*bytes = info.tcpi_bytes_received;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool perf_init(struct perf *p, const char *csv_path)
+{
+	memset(p, 0, sizeof(struct perf));
+	p->start_usec = perf_now_usec();
+	p->window_start_usec = p->start_usec;
+	snprintf(p->hud[0], sizeof(p->hud[0]), "Collecting...");
+	if (csv_path == NULL) {
+		return true;
+	}
+	p->csv = fopen(csv_path, "w");
+	if (!p->csv) {
+		fprintf(stderr, "Failed to open %s for writing\n", csv_path);
+		return false;
+	}
+	fprintf(p->csv,
+		"time_ms,updates,rects,bytes,skipped,decode_us,render_us,output_us,inputs,input_latency_us\n");
+	return true;
+}
+
+void perf_input_sent(struct perf *p, unsigned long inputs,
+		     long long latency_usec)
+{
+	p->frame_inputs += inputs;
+	p->frame_input_usec += latency_usec;
+}
+
+/* Turn the sums of the window into overlay text, and begin a new window. */
+static void perf_close_window(struct perf *p, long long now)
+{
+	struct perf_frame *w = &p->window;
+	double secs = (now - p->window_start_usec) / 1e6;
+	double frames = (p->window_frames > 0) ? p->window_frames : 1;
+	double updates = (w->updates > 0) ? w->updates : 1;
+	snprintf(p->hud[0], sizeof(p->hud[0]), "net %8.1fKB/s %6.1f rect/upd",
+		 w->bytes / 1024.0 / secs, w->rects / updates);
+	snprintf(p->hud[1], sizeof(p->hud[1]), "fps %5.1f  skip %4lu  upd %5lu",
+		 p->window_frames / secs, w->skipped, w->updates);
+	snprintf(p->hud[2], sizeof(p->hud[2]), "ms/frame dec %5.1f ren %5.1f",
+		 w->decode_usec / frames / 1000, w->render_usec / frames / 1000);
+	if (p->window_inputs > 0) {
+		snprintf(p->hud[3], sizeof(p->hud[3]),
+			 "ms/frame out %5.1f  input %5.1f",
+			 w->output_usec / frames / 1000,
+			 (double)p->window_input_usec / p->window_inputs / 1000);
+	} else {
+		snprintf(p->hud[3], sizeof(p->hud[3]),
+			 "ms/frame out %5.1f  input   -",
+			 w->output_usec / frames / 1000);
+	}
+	memset(w, 0, sizeof(struct perf_frame));
+	p->window_frames = 0;
+	p->window_inputs = 0;
+	p->window_input_usec = 0;
+	p->window_start_usec = now;
+	if (p->csv != NULL) {
+		fflush(p->csv);
+	}
+}
+
+void perf_frame_done(struct perf *p, struct perf_frame *f)
+{
+	long long now = perf_now_usec();
+	p->frames++;
+	if (p->csv != NULL) {
+		fprintf(p->csv, "%lld,%lu,%lu,%llu,%lu,%lld,%lld,%lld,%lu,",
+			(now - p->start_usec) / 1000, f->updates, f->rects,
+			f->bytes, f->skipped, f->decode_usec, f->render_usec,
+			f->output_usec, p->frame_inputs);
+		if (p->frame_inputs > 0) {
+			fprintf(p->csv, "%lld\n",
+				p->frame_input_usec / (long long)p->frame_inputs);
+		} else {
+			fprintf(p->csv, "\n");
+		}
+	}
+	struct perf_frame *w = &p->window;
+	w->updates += f->updates;
+	w->rects += f->rects;
+	w->bytes += f->bytes;
+	w->skipped += f->skipped;
+	w->decode_usec += f->decode_usec;
+	w->render_usec += f->render_usec;
+	w->output_usec += f->output_usec;
+	p->window_frames++;
+	p->window_inputs += p->frame_inputs;
+	p->window_input_usec += p->frame_input_usec;
+	p->frame_inputs = 0;
+	p->frame_input_usec = 0;
+	if (now - p->window_start_usec >= PERF_WINDOW_USEC) {
+		perf_close_window(p, now);
+	}
+}
+
+void perf_destroy(struct perf *p)
+{
+	if (p->csv != NULL) {
+		fclose(p->csv);
+	}
+	memset(p, 0, sizeof(struct perf));
+}
@@ -0,0 +1,59 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Overlay figures are averaged over this interval. */
+#define PERF_WINDOW_USEC 1000000
+#define PERF_HUD_LINES 4
+#define PERF_HUD_WIDTH 36
+
+/* Work that went into a rendered frame, from receiving server messages to writing to terminal. */
+struct perf_frame {
+	/* Frame-buffer updates, their rectangles, and bytes received from server for them */
+	unsigned long updates, rects;
+	unsigned long long bytes;
+	/* Snapshots replaced by newer ones before viewer rendered them */
+	unsigned long skipped;
+	/* CPU time of IO thread spent on decoding, and time spent on rendering and terminal output */
+	long long decode_usec, render_usec, output_usec;
+};
+
+/* Collect performance counters of every frame, show their averages in an overlay, and optionally write them to CSV. */
+struct perf {
+	FILE *csv;
+	long long start_usec;
+	unsigned long frames;
+
+	/* Sums over the current window */
+	struct perf_frame window;
+	unsigned long window_frames, window_inputs;
+	long long window_start_usec, window_input_usec;
+	/* Latency between input arriving at the viewer and it being sent to server, since the latest frame */
+	unsigned long frame_inputs;
+	long long frame_input_usec;
+
+	/* Overlay text of the latest complete window */
+	char hud[PERF_HUD_LINES][PERF_HUD_WIDTH + 1];
+};
+
+/* Return the current time of the clock (e.g. CLOCK_MONOTONIC) in microseconds. */
+long long perf_clock_usec(clockid_t clock);
+/* Return the current time of a monotonic clock in microseconds. */
+long long perf_now_usec(void);
+/* Read the number of bytes received so far by TCP socket. Return false only if it is unknown. */
+bool perf_socket_bytes(int fd, unsigned long long *bytes);
+
+/* Initialise counters, write them to the CSV file too unless path is NULL. Return false only on failure. */
+bool perf_init(struct perf *p, const char *csv_path);
+/* Count inputs sent to server, with the sum of their latency since arriving at the viewer. */
+void perf_input_sent(struct perf *p, unsigned long inputs,
+		     long long latency_usec);
+/* Count a rendered frame. */
+void perf_frame_done(struct perf *p, struct perf_frame *f);
+/* Release all resources held by the counters, flush CSV file. */
+void perf_destroy(struct perf *p);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+
+/* Take jobs one after another until there is none left. Caller must hold the pool lock. */
+static void pool_take_jobs(struct pool *p, int thread_num)
+{
+	while (p->next_job < p->num_jobs) {
+		int job = p->next_job++;
+		pthread_mutex_unlock(&p->lock);
+		p->fun(p->arg, job, thread_num);
+		pthread_mutex_lock(&p->lock);
+		p->jobs_done++;
+	}
+	if (p->jobs_done == p->num_jobs) {
+		pthread_cond_broadcast(&p->done);
+	}
+}
+
+/* Wait for a round of jobs and help out, until the pool quits. Return NULL. */
+static void *pool_thread_fun(void *struct_pool_thread)
+{
+	struct pool_thread *t = (struct pool_thread *)struct_pool_thread;
+	struct pool *p = t->pool;
+	unsigned long seen_round = 0;
+	pthread_mutex_lock(&p->lock);
+	while (true) {
+		while (!p->quit && p->round == seen_round) {
+			pthread_cond_wait(&p->start, &p->lock);
+		}
+		if (p->quit) {
+			break;
+		}
+		seen_round = p->round;
+		pool_take_jobs(p, t->num);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+bool pool_init(struct pool *p, int num_threads)
+{
+	memset(p, 0, sizeof(struct pool));
+	if (num_threads <= 0) {
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (num_threads < 1) {
+		num_threads = 1;
+	} else if (num_threads > POOL_MAX_THREADS) {
+		num_threads = POOL_MAX_THREADS;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->threads = calloc(num_threads, sizeof(struct pool_thread));
+	if (!p->threads) {
+		return false;
+	}
+	/* The caller of pool_run is thread 0 */
+	p->num_threads = 1;
+	int i;
+	for (i = 1; i < num_threads; i++) {
+		p->threads[i].pool = p;
+		p->threads[i].num = i;
+		if (pthread_create(&p->threads[i].thread, NULL,
+				   pool_thread_fun, &p->threads[i]) != 0) {
+			fprintf(stderr, "Failed to create render thread\n");
+			return false;
+		}
+		p->num_threads++;
+	}
+	return true;
+}
+
+void pool_run(struct pool *p, pool_job_fun fun, void *arg, int num_jobs)
+{
+	int i;
+	if (p->num_threads <= 1 || num_jobs <= 1) {
+		for (i = 0; i < num_jobs; i++) {
+			fun(arg, i, 0);
+		}
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->fun = fun;
+	p->arg = arg;
+	p->num_jobs = num_jobs;
+	p->next_job = 0;
+	p->jobs_done = 0;
+	p->round++;
+	pthread_cond_broadcast(&p->start);
+	pool_take_jobs(p, 0);
+	while (p->jobs_done < p->num_jobs) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(struct pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	int i;
+	for (i = 1; i < p->num_threads; i++) {
+		pthread_join(p->threads[i].thread, NULL);
+	}
+	free(p->threads);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+}
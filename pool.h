@@ -0,0 +1,40 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define POOL_MAX_THREADS 64
+
+/* A job function receives its job number and the number of the thread (0 is the caller) running it. */
+typedef void (*pool_job_fun)(void *arg, int job, int thread);
+
+struct pool_thread {
+	struct pool *pool;
+	int num;
+	pthread_t thread;
+};
+
+/* Persistent pool of threads that run numbered jobs in parallel. */
+struct pool {
+	struct pool_thread *threads;
+	/* Number of threads including the caller of pool_run */
+	int num_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pool_job_fun fun;
+	void *arg;
+	int num_jobs, next_job, jobs_done;
+	unsigned long round;
+	bool quit;
+};
+
+/* Start the threads of pool, 0 means one thread per CPU. Return false only on failure. */
+bool pool_init(struct pool *p, int num_threads);
+/* Run jobs 0 to num_jobs-1 on the pool threads and the caller. Block caller until all are done. */
+void pool_run(struct pool *p, pool_job_fun fun, void *arg, int num_jobs);
+/* Stop the threads and release all resources held by the pool. */
+void pool_destroy(struct pool *p);
+
+#endif
@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "perf.h"
+#include "rec.h"
+
+/* Size of server initialisation message without desktop name, see RFB protocol. */
+#define REC_SERVER_INIT_SIZE 24
+
+/* Write all bytes to the file descriptor, block caller. Return false only on IO failure. */
+static bool rec_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Read exactly the number of bytes from the file descriptor, block caller. Return false only on IO failure. */
+static bool rec_read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Append a chunk of server bytes to the recording. Return false only on IO failure. */
+static bool rec_write_chunk(struct rec *r, const void *buf, uint32_t len)
+{
+	int64_t usec = perf_now_usec() - r->start_usec;
+	r->bytes += len;
+	return fwrite(&usec, sizeof(usec), 1, r->file) == 1
+	    && fwrite(&len, sizeof(len), 1, r->file) == 1
+	    && fwrite(buf, 1, len, r->file) == len;
+}
+
+/* Turn server initialisation message back into its form on network, RFB client has converted it to host byte order. */
+static void rec_server_init_of(struct _rfbClient *conn,
+			       uint8_t buf[REC_SERVER_INIT_SIZE],
+			       uint32_t name_len)
+{
+	rfbServerInitMsg *si = &conn->si;
+	uint16_t u16;
+	uint32_t u32;
+	u16 = htons(si->framebufferWidth);
+	memcpy(buf, &u16, 2);
+	u16 = htons(si->framebufferHeight);
+	memcpy(buf + 2, &u16, 2);
+	buf[4] = si->format.bitsPerPixel;
+	buf[5] = si->format.depth;
+	buf[6] = si->format.bigEndian;
+	buf[7] = si->format.trueColour;
+	u16 = htons(si->format.redMax);
+	memcpy(buf + 8, &u16, 2);
+	u16 = htons(si->format.greenMax);
+	memcpy(buf + 10, &u16, 2);
+	u16 = htons(si->format.blueMax);
+	memcpy(buf + 12, &u16, 2);
+	buf[14] = si->format.redShift;
+	buf[15] = si->format.greenShift;
+	buf[16] = si->format.blueShift;
+	memset(buf + 17, 0, 3);
+	u32 = htonl(name_len);
+	memcpy(buf + 20, &u32, 4);
+}
+
+/* Forward bytes between RFB client and server, record the bytes from server. Return NULL. */
+static void *rec_relay_fun(void *struct_rec)
+{
+	struct rec *r = (struct rec *)struct_rec;
+	uint8_t *buf = malloc(REC_BUF_SIZE);
+	bool recording = true;
+	struct pollfd fds[2] = {
+		{r->server_fd, POLLIN, 0},
+		{r->relay_fd, POLLIN, 0}
+	};
+	while (buf != NULL && r->cont_relay) {
+		int num = poll(fds, 2, REC_POLL_TIMEOUT_MSEC);
+		if (num < 0 && errno == EINTR) {
+			continue;
+		} else if (num < 0) {
+			break;
+		}
+		if (fds[0].revents != 0) {
+			ssize_t len = read(r->server_fd, buf, REC_BUF_SIZE);
+			if (len <= 0) {
+				break;
+			}
+			if (recording && !rec_write_chunk(r, buf, len)) {
+				rfbClientErr
+				    ("Failed to write recording, the rest of session is not recorded\n");
+				recording = false;
+			}
+			if (!rec_write_all(r->relay_fd, buf, len)) {
+				break;
+			}
+		}
+		if (fds[1].revents != 0) {
+			ssize_t len = read(r->relay_fd, buf, REC_BUF_SIZE);
+			if (len <= 0 || !rec_write_all(r->server_fd, buf, len)) {
+				break;
+			}
+		}
+	}
+	/* Let RFB client see the connection end */
+	shutdown(r->relay_fd, SHUT_RDWR);
+	free(buf);
+	return NULL;
+}
+
+bool rec_start(struct rec *r, const char *path, struct _rfbClient *conn,
+	       int depth)
+{
+	memset(r, 0, sizeof(struct rec));
+	r->server_fd = -1;
+	r->relay_fd = -1;
+	r->file = fopen(path, "wb");
+	if (!r->file) {
+		fprintf(stderr, "Failed to open %s for writing\n", path);
+		return false;
+	}
+	uint8_t server_init[REC_SERVER_INIT_SIZE];
+	uint32_t name_len = strlen(conn->desktopName);
+	uint32_t init_len = REC_SERVER_INIT_SIZE + name_len;
+	int32_t depth32 = depth;
+	rec_server_init_of(conn, server_init, name_len);
+	r->start_usec = perf_now_usec();
+	/* RFB client may have read past the handshake into its buffer, those bytes come first */
+	if (fwrite(REC_MAGIC, 1, 8, r->file) != 8
+	    || fwrite(&depth32, sizeof(depth32), 1, r->file) != 1
+	    || fwrite(&init_len, sizeof(init_len), 1, r->file) != 1
+	    || fwrite(server_init, 1, sizeof(server_init), r->file) !=
+	    sizeof(server_init)
+	    || fwrite(conn->desktopName, 1, name_len, r->file) != name_len
+	    || (conn->buffered > 0
+		&& !rec_write_chunk(r, conn->bufoutptr, conn->buffered))) {
+		fprintf(stderr, "Failed to write recording header to %s\n",
+			path);
+		fclose(r->file);
+		return false;
+	}
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+		fprintf(stderr, "Failed to create socket pair for recording\n");
+		fclose(r->file);
+		return false;
+	}
+	r->server_fd = conn->sock;
+	r->relay_fd = pair[1];
+	conn->sock = pair[0];
+	r->cont_relay = true;
+	if (pthread_create(&r->relay, NULL, rec_relay_fun, (void *)r) != 0) {
+		fprintf(stderr, "Failed to create recording relay thread\n");
+		conn->sock = r->server_fd;
+		close(pair[0]);
+		close(pair[1]);
+		fclose(r->file);
+		return false;
+	}
+	return true;
+}
+
+void rec_stop(struct rec *r)
+{
+	r->cont_relay = false;
+	if (pthread_join(r->relay, NULL) != 0) {
+		fprintf(stderr, "Failed to join recording relay thread\n");
+	}
+	rfbClientLog("Recorded %llu bytes in %.1f seconds\n", r->bytes,
+		     (perf_now_usec() - r->start_usec) / 1e6);
+	fclose(r->file);
+	close(r->server_fd);
+	close(r->relay_fd);
+	memset(r, 0, sizeof(struct rec));
+}
+
+/*
+ * Send bytes to client, meanwhile read and discard what client sends, so that neither side
+ * blocks the other. Return false only on IO failure.
+ */
+static bool rec_replay_send(int fd, const uint8_t *buf, size_t len,
+			    uint8_t *scratch)
+{
+	while (len > 0) {
+		struct pollfd pfd = { fd, POLLIN | POLLOUT, 0 };
+		if (poll(&pfd, 1, REC_POLL_TIMEOUT_MSEC) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (read(fd, scratch, REC_BUF_SIZE) <= 0) {
+				return false;
+			}
+		}
+		if (pfd.revents & POLLOUT) {
+			ssize_t n = write(fd, buf, len);
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				return false;
+			} else if (n > 0) {
+				buf += n;
+				len -= n;
+			}
+		}
+	}
+	return true;
+}
+
+/* Read and discard what client sends until the time comes. Return false only on IO failure. */
+static bool rec_replay_wait(struct rec_replay *p, int fd, long long until_usec,
+			    uint8_t *scratch)
+{
+	long long now;
+	while (p->cont_server && (now = perf_now_usec()) < until_usec) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int timeout = (until_usec - now + 999) / 1000;
+		if (timeout > REC_POLL_TIMEOUT_MSEC) {
+			timeout = REC_POLL_TIMEOUT_MSEC;
+		}
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (pfd.revents != 0 && read(fd, scratch, REC_BUF_SIZE) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Do the server side of handshake, RFB 3.8 without authentication. Return false only on IO failure. */
+static bool rec_replay_handshake(struct rec_replay *p, int fd)
+{
+	char version[12];
+	uint8_t security[2] = { 1, 1 }, choice, shared;
+	uint32_t result = 0;
+	return rec_write_all(fd, "RFB 003.008\n", 12)
+	    && rec_read_all(fd, version, sizeof(version))
+	    && rec_write_all(fd, security, sizeof(security))
+	    && rec_read_all(fd, &choice, 1)
+	    && rec_write_all(fd, &result, sizeof(result))
+	    && rec_read_all(fd, &shared, 1)
+	    && rec_write_all(fd, p->server_init, p->server_init_len);
+}
+
+/* Send the recorded chunks to client until the end of recording. */
+static void rec_replay_stream(struct rec_replay *p, int fd, uint8_t *buf,
+			      uint8_t *scratch)
+{
+	long long start = perf_now_usec();
+	int64_t usec;
+	uint32_t len;
+	while (p->cont_server) {
+		if (fread(&usec, sizeof(usec), 1, p->file) != 1
+		    || fread(&len, sizeof(len), 1, p->file) != 1) {
+			/* The end of recording */
+			break;
+		}
+		if (len > REC_BUF_SIZE || fread(buf, 1, len, p->file) != len) {
+			rfbClientErr("Recording is truncated or corrupted\n");
+			break;
+		}
+		if (p->realtime && !rec_replay_wait(p, fd, start + usec, scratch)) {
+			break;
+		}
+		if (!rec_replay_send(fd, buf, len, scratch)) {
+			break;
+		}
+		p->bytes += len;
+	}
+}
+
+/* Wait for client to connect, then serve it the recording. Return NULL. */
+static void *rec_replay_fun(void *struct_replay)
+{
+	struct rec_replay *p = (struct rec_replay *)struct_replay;
+	uint8_t *buf = malloc(REC_BUF_SIZE), *scratch = malloc(REC_BUF_SIZE);
+	int fd = -1;
+	while (buf != NULL && scratch != NULL && p->cont_server) {
+		struct pollfd pfd = { p->listen_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, REC_POLL_TIMEOUT_MSEC) > 0) {
+			fd = accept(p->listen_fd, NULL, NULL);
+			break;
+		}
+	}
+	if (fd != -1 && rec_replay_handshake(p, fd)) {
+		rec_replay_stream(p, fd, buf, scratch);
+	}
+	/* Client sees the connection end just like a server going away */
+	if (fd != -1) {
+		close(fd);
+	}
+	free(buf);
+	free(scratch);
+	return NULL;
+}
+
+bool rec_replay_start(struct rec_replay *p, const char *path, bool realtime)
+{
+	memset(p, 0, sizeof(struct rec_replay));
+	p->listen_fd = -1;
+	p->realtime = realtime;
+	p->file = fopen(path, "rb");
+	if (!p->file) {
+		fprintf(stderr, "Failed to open %s for reading\n", path);
+		return false;
+	}
+	char magic[8];
+	int32_t depth32;
+	if (fread(magic, 1, 8, p->file) != 8
+	    || memcmp(magic, REC_MAGIC, 8) != 0
+	    || fread(&depth32, sizeof(depth32), 1, p->file) != 1
+	    || fread(&p->server_init_len, sizeof(p->server_init_len), 1,
+		     p->file) != 1 || p->server_init_len < REC_SERVER_INIT_SIZE
+	    || p->server_init_len > REC_BUF_SIZE) {
+		fprintf(stderr, "%s is not a recording of headmore\n", path);
+		fclose(p->file);
+		return false;
+	}
+	p->depth = depth32;
+	p->server_init = malloc(p->server_init_len);
+	if (!p->server_init
+	    || fread(p->server_init, 1, p->server_init_len,
+		     p->file) != p->server_init_len) {
+		fprintf(stderr, "Failed to read recording header from %s\n",
+			path);
+		free(p->server_init);
+		fclose(p->file);
+		return false;
+	}
+	/* The socket lives in a private directory, so that no one else can connect to it */
+	strcpy(p->dir, "/tmp/headmore-replay-XXXXXX");
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (mkdtemp(p->dir) == NULL) {
+		fprintf(stderr, "Failed to create directory for replay socket\n");
+		free(p->server_init);
+		fclose(p->file);
+		return false;
+	}
+	snprintf(p->sock_path, sizeof(p->sock_path), "%s/rfb.sock", p->dir);
+	strncpy(addr.sun_path, p->sock_path, sizeof(addr.sun_path) - 1);
+	p->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (p->listen_fd == -1
+	    || bind(p->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(p->listen_fd, 1) != 0) {
+		fprintf(stderr, "Failed to listen on %s\n", p->sock_path);
+		rec_replay_stop(p);
+		return false;
+	}
+	p->cont_server = true;
+	if (pthread_create(&p->server, NULL, rec_replay_fun, (void *)p) != 0) {
+		fprintf(stderr, "Failed to create replay server thread\n");
+		p->cont_server = false;
+		rec_replay_stop(p);
+		return false;
+	}
+	return true;
+}
+
+void rec_replay_stop(struct rec_replay *p)
+{
+	if (p->cont_server) {
+		p->cont_server = false;
+		if (pthread_join(p->server, NULL) != 0) {
+			fprintf(stderr, "Failed to join replay server thread\n");
+		}
+	}
+	if (p->listen_fd != -1) {
+		close(p->listen_fd);
+	}
+	unlink(p->sock_path);
+	rmdir(p->dir);
+	free(p->server_init);
+	fclose(p->file);
+	memset(p, 0, sizeof(struct rec_replay));
+}
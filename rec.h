@@ -0,0 +1,70 @@
+#ifndef REC_H
+#define REC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <rfb/rfbclient.h>
+
+#define REC_MAGIC "HMREC001"	/* Every recording begins with these 8 bytes */
+#define REC_BUF_SIZE 65536	/* Bytes relayed in one go, at most one chunk of recording */
+#define REC_POLL_TIMEOUT_MSEC 100	/* A lower value enables faster termination of relay and replay */
+
+/*
+ * Relay between RFB client and server, which records everything server sends after the handshake.
+ * A recording consists of:
+ * - The magic, and the pixel depth requested by client (32-bit integer, see enum vnc_depth).
+ * - Length of server initialisation message (32-bit integer) and the message as sent over network.
+ * - Chunks of server bytes, each chunk is its time since beginning of recording in microseconds
+ *   (64-bit integer), its length (32-bit integer), and the bytes.
+ * Integers are in the byte order of this computer, a recording is meant to be replayed on the computer
+ * that recorded it.
+ */
+struct rec {
+	FILE *file;
+	/* The connection to server, and the end of socket pair that RFB client does not use */
+	int server_fd, relay_fd;
+	pthread_t relay;
+	bool cont_relay;
+	long long start_usec;
+	unsigned long long bytes;
+};
+
+/*
+ * Serve a recording to an RFB client over a UNIX socket, without network. Handshake is done without
+ * authentication, and then the recorded chunks are sent either as fast as client takes them or at
+ * the pace they were recorded. Whatever client sends is ignored.
+ */
+struct rec_replay {
+	FILE *file;
+	int depth;
+	uint8_t *server_init;
+	uint32_t server_init_len;
+	/* Client connects to the socket path, which resides in a private temporary directory */
+	char dir[64], sock_path[96];
+	int listen_fd;
+	bool realtime;
+	pthread_t server;
+	bool cont_server;
+	/* Bytes sent to client, read by RFB client as the bytes received since its socket cannot tell */
+	atomic_ullong bytes;
+};
+
+/*
+ * Begin recording the connected RFB client into the file, client must not be handling messages yet.
+ * Its socket is replaced by one end of a socket pair, and a relay thread forwards between the other
+ * end and server. Return false only on failure.
+ */
+bool rec_start(struct rec *r, const char *path, struct _rfbClient *conn,
+	       int depth);
+/* Stop relaying and close the recording, RFB client sees its connection closed. */
+void rec_stop(struct rec *r);
+
+/* Open the recording and listen on a UNIX socket for RFB client to connect. Return false only on failure. */
+bool rec_replay_start(struct rec_replay *p, const char *path, bool realtime);
+/* Stop serving and release all resources of the replay. */
+void rec_replay_stop(struct rec_replay *p);
+
+#endif
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "render.h"
+
+struct render_fb render_fb_of(struct vnc *vnc)
+{
+	struct render_fb ret;
+	ret.width = vnc->width;
+	ret.height = vnc->height;
+	ret.bpp = 32;
+	ret.pitch = ret.width * 4;
+	ret.rmask = vnc->rmask;
+	ret.gmask = vnc->gmask;
+	ret.bmask = vnc->bmask;
+	ret.pixels = vnc->snapshot;
+	return ret;
+}
+
+bool render_init(struct render *r, struct pool *pool)
+{
+	memset(r, 0, sizeof(struct render));
+	r->scratch = caca_create_canvas(0, 0);
+	if (!r->scratch) {
+		fprintf(stderr, "Failed to create caca canvas\n");
+		return false;
+	}
+	if (!native_init(&r->native, pool)) {
+		return false;
+	}
+	mip_init(&r->mip);
+	render_set_algorithm(r, RENDER_DEFAULT_ALGORITHM,
+			     RENDER_DEFAULT_GAMMA);
+	return true;
+}
+
+void render_set_mode(struct render *r, enum render_mode mode)
+{
+	r->mode = mode;
+	/* Make render_prepare decide again whether native renderer is usable */
+	r->algorithm_changed = true;
+}
+
+void render_set_algorithm(struct render *r, const char *algorithm, float gamma)
+{
+	if (strcmp(r->algorithm, algorithm) == 0 && r->gamma == gamma) {
+		return;
+	}
+	strncpy(r->algorithm, algorithm, sizeof(r->algorithm) - 1);
+	r->gamma = gamma;
+	r->algorithm_changed = true;
+}
+
+/* Return true only if both frame-buffers share the same size and pixel format. */
+static bool render_fb_same_format(struct render_fb *a, struct render_fb *b)
+{
+	return a->width == b->width && a->height == b->height
+	    && a->bpp == b->bpp && a->pitch == b->pitch
+	    && a->rmask == b->rmask && a->gmask == b->gmask
+	    && a->bmask == b->bmask;
+}
+
+bool render_prepare(struct render *r, struct render_fb fb,
+		    struct vnc_damage *damage,
+		    struct geo_dither_params *params)
+{
+	/* Averaging a pyramid level works on byte lanes, without a pyramid the frame-buffer is sampled in full */
+	r->use_mip = native_supports(fb.bpp, fb.rmask, fb.gmask, fb.bmask)
+	    && mip_resize(&r->mip, fb.width, fb.height);
+	r->lvl = r->use_mip ? mip_lvl_of(&r->mip, params) : 0;
+	struct render_fb lvl_fb = fb;
+	if (r->use_mip) {
+		mip_update(&r->mip, fb.pixels, damage, r->lvl);
+		lvl_fb.width = r->mip.lvls[r->lvl].width;
+		lvl_fb.height = r->mip.lvls[r->lvl].height;
+		lvl_fb.pitch = lvl_fb.width * 4;
+		lvl_fb.pixels = r->mip.lvls[r->lvl].pixels;
+	}
+	/* Pixels may move around in memory without affecting the dither itself */
+	if (r->dither == NULL || !render_fb_same_format(&lvl_fb, &r->lvl_fb)) {
+		if (r->dither != NULL) {
+			caca_free_dither(r->dither);
+		}
+		r->dither =
+		    caca_create_dither(lvl_fb.bpp, lvl_fb.width, lvl_fb.height,
+				       lvl_fb.pitch, lvl_fb.rmask, lvl_fb.gmask,
+				       lvl_fb.bmask, 0);
+		if (r->dither == NULL) {
+			return false;
+		}
+		r->algorithm_changed = true;
+	}
+	if (r->algorithm_changed) {
+		caca_set_dither_algorithm(r->dither, r->algorithm);
+		caca_set_dither_gamma(r->dither, r->gamma);
+		r->use_native = r->mode != RENDER_CACA
+		    && native_supports(fb.bpp, fb.rmask, fb.gmask, fb.bmask);
+		native_set_format(&r->native, fb.rmask, fb.gmask, fb.bmask,
+				  r->algorithm, r->mode == RENDER_HALF_BLOCK);
+		r->algorithm_changed = false;
+	}
+	r->fb = fb;
+	r->lvl_fb = lvl_fb;
+	return true;
+}
+
+/* Return the geometry in pixels of the pyramid level being sampled. */
+static struct geo_dither_params render_lvl_params(struct render *r,
+						  struct geo_dither_params
+						  *params)
+{
+	struct geo_dither_params ret = *params;
+	ret.facts.vnc_width = r->lvl_fb.width;
+	ret.facts.vnc_height = r->lvl_fb.height;
+	return ret;
+}
+
+void render_full(struct render *r, caca_canvas_t * canvas,
+		 struct geo_dither_params *params)
+{
+	struct geo_dither_params lvl_params = render_lvl_params(r, params);
+	caca_set_color_ansi(canvas, CACA_DEFAULT, CACA_DEFAULT);
+	caca_clear_canvas(canvas);
+	if (r->use_native) {
+		struct geo_rect all =
+		    { 0, 0, params->facts.ch_width, params->facts.ch_height };
+		native_render(&r->native, canvas, &lvl_params, all,
+			      r->lvl_fb.pixels, r->lvl_fb.pitch);
+		return;
+	}
+	caca_dither_bitmap(canvas, params->x, params->y, params->width,
+			   params->height, r->dither, r->lvl_fb.pixels);
+}
+
+void render_rect(struct render *r, caca_canvas_t * canvas,
+		 struct geo_dither_params *params, struct geo_rect rect)
+{
+	if (rect.x < 0) {
+		rect.width += rect.x;
+		rect.x = 0;
+	}
+	if (rect.y < 0) {
+		rect.height += rect.y;
+		rect.y = 0;
+	}
+	if (rect.x + rect.width > params->facts.ch_width) {
+		rect.width = params->facts.ch_width - rect.x;
+	}
+	if (rect.y + rect.height > params->facts.ch_height) {
+		rect.height = params->facts.ch_height - rect.y;
+	}
+	if (rect.width <= 0 || rect.height <= 0) {
+		return;
+	}
+	struct geo_dither_params lvl_params = render_lvl_params(r, params);
+	if (r->use_native) {
+		/* Characters outside of the image are left alone, clear them first */
+		caca_set_color_ansi(canvas, CACA_DEFAULT, CACA_DEFAULT);
+		caca_fill_box(canvas, rect.x, rect.y, rect.width, rect.height,
+			      ' ');
+		native_render(&r->native, canvas, &lvl_params, rect,
+			      r->lvl_fb.pixels, r->lvl_fb.pitch);
+		return;
+	}
+	/*
+	 * Dither onto a scratch canvas of exactly the rectangle size. The image is
+	 * offset such that libcaca only computes the characters inside rectangle.
+	 * Scratch canvas is resized only if necessary, as resizing reallocates memory.
+	 */
+	if (caca_get_canvas_width(r->scratch) != rect.width
+	    || caca_get_canvas_height(r->scratch) != rect.height) {
+		caca_set_canvas_size(r->scratch, rect.width, rect.height);
+	}
+	caca_set_color_ansi(r->scratch, CACA_DEFAULT, CACA_DEFAULT);
+	caca_clear_canvas(r->scratch);
+	caca_dither_bitmap(r->scratch, params->x - rect.x, params->y - rect.y,
+			   params->width, params->height, r->dither,
+			   r->lvl_fb.pixels);
+	caca_blit(canvas, rect.x, rect.y, r->scratch, NULL);
+}
+
+/* Colour sum of the opaque cursor pixels covering a half of character. */
+struct render_cursor_half {
+	int opaque, total;
+	unsigned int r, g, b;
+};
+
+/* Sum up the opaque cursor pixels in the frame-buffer pixels [x1, x2) [y1, y2), cursor begins at left/top. */
+static void render_cursor_sum(struct render *r, struct vnc_cursor *cursor,
+			      int left, int top, int x1, int y1, int x2,
+			      int y2, struct render_cursor_half *half)
+{
+	memset(half, 0, sizeof(struct render_cursor_half));
+	/* A half narrower or shorter than a pixel samples the pixel under it */
+	if (x2 <= x1) {
+		x2 = x1 + 1;
+	}
+	if (y2 <= y1) {
+		y2 = y1 + 1;
+	}
+	half->total = (x2 - x1) * (y2 - y1);
+	int x, y;
+	for (y = (y1 > top) ? y1 : top;
+	     y < y2 && y < top + cursor->height; y++) {
+		for (x = (x1 > left) ? x1 : left;
+		     x < x2 && x < left + cursor->width; x++) {
+			size_t i = (size_t)(y - top) * cursor->width + (x - left);
+			if (!cursor->mask[i]) {
+				continue;
+			}
+			uint32_t px = cursor->pixels[i];
+			half->opaque++;
+			half->r += (px >> (r->native.lane_r * 8)) & 0xff;
+			half->g += (px >> (r->native.lane_g * 8)) & 0xff;
+			half->b += (px >> (r->native.lane_b * 8)) & 0xff;
+		}
+	}
+}
+
+/* Return the 12-bit RGB average of the opaque pixels of half. */
+static uint16_t render_cursor_rgb12(struct render_cursor_half *half)
+{
+	return (half->r / half->opaque >> 4) << 8 |
+	    (half->g / half->opaque >> 4) << 4 | (half->b / half->opaque >> 4);
+}
+
+/* Paint the halves of character in their cursor colour, an unpainted half keeps the colour it had. */
+static void render_cursor_cell(caca_canvas_t * canvas, int x, int y,
+			       struct render_cursor_half *upper,
+			       struct render_cursor_half *lower)
+{
+	uint32_t attr = caca_get_attr(canvas, x, y);
+	/* Upper half of a half block is its foreground, any other character is taken as its background */
+	uint16_t up = (caca_get_char(canvas, x, y) == NATIVE_HALF_BLOCK) ?
+	    caca_attr_to_rgb12_fg(attr) : caca_attr_to_rgb12_bg(attr);
+	uint16_t down = caca_attr_to_rgb12_bg(attr);
+	if (upper != NULL) {
+		up = render_cursor_rgb12(upper);
+	}
+	if (lower != NULL) {
+		down = render_cursor_rgb12(lower);
+	}
+	caca_set_color_argb(canvas, 0xf000 | up, 0xf000 | down);
+	caca_put_char(canvas, x, y, NATIVE_HALF_BLOCK);
+}
+
+struct geo_rect render_cursor(struct render *r, caca_canvas_t * canvas,
+			      struct geo_dither_params *params,
+			      struct vnc_cursor *cursor, int px_x, int px_y)
+{
+	struct geo_rect none = { 0, 0, 0, 0 };
+	struct geo_facts *f = &params->facts;
+	/* Cursor colours are read from byte lanes like the native renderer does */
+	if (cursor->width <= 0 || cursor->height <= 0 || params->width <= 0
+	    || params->height <= 0 || f->vnc_width <= 0 || f->vnc_height <= 0
+	    || r->native.lane_r < 0 || r->native.lane_g < 0
+	    || r->native.lane_b < 0) {
+		return none;
+	}
+	int left = px_x - cursor->xhot, top = px_y - cursor->yhot;
+	struct geo_rect rect = geo_dither_ch_rect(params, left, top,
+						  cursor->width,
+						  cursor->height);
+	/* Frame-buffer pixels covered by a character */
+	float px_per_ch_x = (float)f->vnc_width / params->width;
+	float px_per_ch_y = (float)f->vnc_height / params->height;
+	bool painted = false;
+	int x, y;
+	for (y = rect.y; y < rect.y + rect.height; y++) {
+		float top_y = (y - params->y) * px_per_ch_y;
+		int y1 = top_y, y_mid = top_y + px_per_ch_y / 2;
+		int y2 = top_y + px_per_ch_y;
+		for (x = rect.x; x < rect.x + rect.width; x++) {
+			int x1 = (x - params->x) * px_per_ch_x;
+			int x2 = (x + 1 - params->x) * px_per_ch_x;
+			struct render_cursor_half upper, lower;
+			render_cursor_sum(r, cursor, left, top, x1, y1, x2,
+					  y_mid, &upper);
+			render_cursor_sum(r, cursor, left, top, x1, y_mid, x2,
+					  y2, &lower);
+			bool paint_upper = upper.opaque > 0 &&
+			    upper.opaque >= upper.total * RENDER_CURSOR_COVERAGE;
+			bool paint_lower = lower.opaque > 0 &&
+			    lower.opaque >= lower.total * RENDER_CURSOR_COVERAGE;
+			if (paint_upper || paint_lower) {
+				render_cursor_cell(canvas, x, y,
+						   paint_upper ? &upper : NULL,
+						   paint_lower ? &lower : NULL);
+				painted = true;
+			}
+		}
+	}
+	if (painted) {
+		return rect;
+	}
+	/* Cursor is smaller than half a character, mark the half under hotspot in the colour of cursor */
+	struct render_cursor_half all;
+	render_cursor_sum(r, cursor, left, top, left, top,
+			  left + cursor->width, top + cursor->height, &all);
+	float hot_y = (float)px_y / px_per_ch_y + params->y;
+	x = px_x / px_per_ch_x + params->x;
+	y = hot_y;
+	if (all.opaque == 0 || x < 0 || y < 0 || x >= f->ch_width
+	    || y >= f->ch_height) {
+		return none;
+	}
+	bool hot_upper = hot_y - y < 0.5f;
+	render_cursor_cell(canvas, x, y, hot_upper ? &all : NULL,
+			   hot_upper ? NULL : &all);
+	struct geo_rect hot = { x, y, 1, 1 };
+	return hot;
+}
+
+void render_destroy(struct render *r)
+{
+	native_destroy(&r->native);
+	mip_destroy(&r->mip);
+	if (r->dither != NULL) {
+		caca_free_dither(r->dither);
+		r->dither = NULL;
+	}
+	if (r->scratch != NULL) {
+		caca_free_canvas(r->scratch);
+		r->scratch = NULL;
+	}
+}
@@ -0,0 +1,92 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "geo.h"
+#include "mip.h"
+#include "native.h"
+#include "vnc.h"
+
+#define RENDER_DEFAULT_ALGORITHM "fstein"
+#define RENDER_DEFAULT_GAMMA 1.0f
+/* Half of a character is painted in cursor colour if cursor covers at least this fraction of it. */
+#define RENDER_CURSOR_COVERAGE 0.5f
+
+/* Which renderer turns pixels into characters. */
+enum render_mode {
+	RENDER_NATIVE,		/* Built-in renderer, used if it understands the pixel format */
+	RENDER_CACA,		/* Dither of libcaca, understands any pixel format */
+	RENDER_HALF_BLOCK	/* Built-in renderer drawing two colours per character with half blocks */
+};
+
+/* Layout of frame-buffer pixels in memory. */
+struct render_fb {
+	int width, height, bpp, pitch;
+	uint32_t rmask, gmask, bmask;
+	void *pixels;
+};
+
+/* Return the frame-buffer snapshot and its pixel format of the VNC connection. */
+struct render_fb render_fb_of(struct vnc *vnc);
+
+/*
+ * Dither pipeline that turns frame-buffer pixels into characters on canvas.
+ * The pipeline is built once, and rebuilt only when frame-buffer size or pixel format changes.
+ */
+struct render {
+	enum render_mode mode;
+	struct native native;
+	bool use_native;
+
+	/*
+	 * Frame-buffer is sampled from the level of its pyramid nearest to the characters, and dither
+	 * is built for the pixels of that level. Pyramid is used only if every channel is a byte.
+	 */
+	caca_dither_t *dither;
+	struct render_fb fb, lvl_fb;
+	struct mip mip;
+	bool use_mip;
+	int lvl;
+	char algorithm[16];
+	float gamma;
+	bool algorithm_changed;
+
+	/* Scratch canvas for dithering a part of the image */
+	caca_canvas_t *scratch;
+};
+
+/* Initialise render pipeline with default algorithm and gamma, it renders in parallel on the pool. Return false only on failure. */
+bool render_init(struct render *r, struct pool *pool);
+/* Choose the renderer for the following frames. */
+void render_set_mode(struct render *r, enum render_mode mode);
+/* Change dithering algorithm (as understood by libcaca) and gamma, to take effect in the next frame. */
+void render_set_algorithm(struct render *r, const char *algorithm, float gamma);
+/*
+ * Make pipeline ready to dither the frame-buffer in the geometry, rebuild it only if necessary.
+ * The damage since the previous frame is reduced into the pyramid level to be sampled.
+ * Return false only on failure.
+ */
+bool render_prepare(struct render *r, struct render_fb fb,
+		    struct vnc_damage *damage,
+		    struct geo_dither_params *params);
+/* Clear canvas and dither the entire frame-buffer onto it. */
+void render_full(struct render *r, caca_canvas_t * canvas,
+		 struct geo_dither_params *params);
+/* Dither the rectangle of characters again, leave the rest of canvas alone. */
+void render_rect(struct render *r, caca_canvas_t * canvas,
+		 struct geo_dither_params *params, struct geo_rect rect);
+/*
+ * Paint the cursor with its hotspot at the frame-buffer pixel over the characters of canvas, using
+ * half blocks for the upper and lower half of a character. The half under hotspot is painted even if
+ * the cursor is too small to cover any half. Return the characters painted over, which render_rect
+ * restores; width and height are 0 if cursor is not visible.
+ */
+struct geo_rect render_cursor(struct render *r, caca_canvas_t * canvas,
+			      struct geo_dither_params *params,
+			      struct vnc_cursor *cursor, int px_x, int px_y);
+/* Release all resources held by the pipeline. */
+void render_destroy(struct render *r);
+
+#endif
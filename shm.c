@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm.h"
+
+/* Grow the segment and its mapping to the size. Return false only on failure. */
+static bool shm_grow(struct shm *s, size_t map_size)
+{
+	if (map_size <= s->map_size) {
+		return true;
+	}
+	if (ftruncate(s->fd, map_size) != 0) {
+		perror("Failed to resize shared memory");
+		return false;
+	}
+	if (s->header != NULL) {
+		munmap(s->header, s->map_size);
+		s->header = NULL;
+		s->map_size = 0;
+	}
+	void *mem =
+	    mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("Failed to map shared memory");
+		return false;
+	}
+#ifdef MADV_HUGEPAGE
+	/* Large frame-buffers take fewer TLB entries in huge pages, kernel may ignore the advice */
+	if (map_size - SHM_PIXELS_OFFSET >= SHM_HUGE_PAGE_MIN_BYTES) {
+		madvise(mem, map_size, MADV_HUGEPAGE);
+	}
+#endif
+	s->header = (struct shm_header *)mem;
+	s->map_size = map_size;
+	return true;
+}
+
+bool shm_init(struct shm *s, const char *name)
+{
+	memset(s, 0, sizeof(struct shm));
+	strncpy(s->name, name, sizeof(s->name) - 1);
+	/* Only the same user may read the pixels of remote desktop */
+	s->fd = shm_open(s->name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+	if (s->fd == -1) {
+		perror("Failed to create shared memory");
+		return false;
+	}
+	/* Header is there from the beginning, frame-buffer follows once its size is known */
+	if (!shm_grow(s, SHM_PIXELS_OFFSET)) {
+		return false;
+	}
+	s->header->magic = SHM_MAGIC;
+	s->header->version = SHM_VERSION;
+	s->header->map_size = s->map_size;
+	return true;
+}
+
+uint32_t *shm_resize(struct shm *s, int width, int height, uint32_t rmask,
+		     uint32_t gmask, uint32_t bmask)
+{
+	size_t px_bytes = (size_t)width * height * sizeof(uint32_t);
+	if (!shm_grow(s, SHM_PIXELS_OFFSET + px_bytes)) {
+		return NULL;
+	}
+	struct shm_header *h = s->header;
+	h->magic = SHM_MAGIC;
+	h->version = SHM_VERSION;
+	h->map_size = s->map_size;
+	h->width = width;
+	h->height = height;
+	h->pitch = width * sizeof(uint32_t);
+	h->rmask = rmask;
+	h->gmask = gmask;
+	h->bmask = bmask;
+	uint32_t *pixels = (uint32_t *) ((uint8_t *) h + SHM_PIXELS_OFFSET);
+	memset(pixels, 0, px_bytes);
+	return pixels;
+}
+
+void shm_begin(struct shm *s)
+{
+	uint64_t seq = atomic_load_explicit(&s->header->seq,
+					    memory_order_relaxed);
+	atomic_store_explicit(&s->header->seq, seq + 1, memory_order_relaxed);
+	/* Consumers must see the odd sequence before any pixel changes */
+	atomic_thread_fence(memory_order_release);
+}
+
+void shm_end(struct shm *s, const struct shm_rect *rects, int num_rects,
+	     bool full)
+{
+	struct shm_header *h = s->header;
+	if (full || num_rects > SHM_MAX_DIRTY_RECTS) {
+		h->dirty_full = 1;
+		h->num_dirty = 0;
+	} else {
+		h->dirty_full = 0;
+		h->num_dirty = num_rects;
+		memcpy(h->dirty, rects, num_rects * sizeof(struct shm_rect));
+	}
+	uint64_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+	atomic_store_explicit(&h->seq, seq + 1, memory_order_release);
+}
+
+void shm_destroy(struct shm *s)
+{
+	if (s->header != NULL) {
+		munmap(s->header, s->map_size);
+	}
+	if (s->fd != -1) {
+		close(s->fd);
+		shm_unlink(s->name);
+	}
+	memset(s, 0, sizeof(struct shm));
+	s->fd = -1;
+}
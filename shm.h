@@ -0,0 +1,64 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x42464d48	/* "HMFB" in the byte order of x86 */
+#define SHM_VERSION 1
+#define SHM_PIXELS_OFFSET 4096	/* Pixels begin on the page after header */
+#define SHM_MAX_DIRTY_RECTS 32	/* Beyond this many rectangles, an update is marked as full */
+#define SHM_HUGE_PAGE_MIN_BYTES (8 << 20)	/* Ask for huge pages if pixels take at least this much memory */
+
+/* A rectangle of pixels updated by server. */
+struct shm_rect {
+	uint32_t x, y, w, h;
+};
+
+/*
+ * Header at the beginning of shared memory, followed by 32-bit pixels at SHM_PIXELS_OFFSET.
+ * Integers are in the byte order of this computer. Pixels and header change together under a
+ * sequence lock: seq is odd while they change, and becomes even (and greater) once they are done.
+ * A consumer reads seq, copies what it needs, and keeps the copy only if seq is still the same
+ * even number. If map_size grows, the consumer maps the memory again.
+ */
+struct shm_header {
+	uint32_t magic, version;
+	/* Bytes of the whole segment, header included */
+	uint64_t map_size;
+	atomic_uint_least64_t seq;
+	uint32_t width, height, pitch;
+	/* Colour masks of 32-bit pixels, every channel is a byte */
+	uint32_t rmask, gmask, bmask;
+	/* Regions changed by the latest update, all of frame-buffer if dirty_full is set */
+	uint32_t dirty_full, num_dirty;
+	struct shm_rect dirty[SHM_MAX_DIRTY_RECTS];
+};
+
+/* Frame-buffer snapshot placed in a named POSIX shared memory segment, for local tools to map read-only. */
+struct shm {
+	char name[256];
+	int fd;
+	struct shm_header *header;
+	size_t map_size;
+};
+
+/* Create the named segment (e.g. "/headmore"), replacing an existing one. Return false only on failure. */
+bool shm_init(struct shm *s, const char *name);
+/*
+ * Make room for pixels of the size, with header describing them, and return the (zeroed) pixels.
+ * Caller holds the sequence between shm_begin and shm_end. Return NULL only on failure.
+ */
+uint32_t *shm_resize(struct shm *s, int width, int height, uint32_t rmask,
+		     uint32_t gmask, uint32_t bmask);
+/* Tell consumers that pixels are about to change. */
+void shm_begin(struct shm *s);
+/* Tell consumers that pixels have changed in the rectangles, or entirely if full is set. */
+void shm_end(struct shm *s, const struct shm_rect *rects, int num_rects,
+	     bool full);
+/* Unmap and remove the segment, consumers that mapped it keep their mapping. */
+void shm_destroy(struct shm *s);
+
+#endif
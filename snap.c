@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "opt.h"
+#include "snap.h"
+#include "viewer.h"
+#include "vnc.h"
+
+/* Wait until IO thread publishes an update or the connection is lost, but not past the time. Return true only if there is an update. */
+static bool snap_wait_update(struct vnc *vnc, long long until_usec)
+{
+	while (vnc->connected) {
+		long long now = perf_now_usec();
+		if (now >= until_usec) {
+			return false;
+		}
+		struct pollfd pfd = { vnc_notify_fd(vnc), POLLIN, 0 };
+		poll(&pfd, 1, (until_usec - now + 999) / 1000);
+		if (vnc_take_notification(vnc)) {
+			return vnc->connected;
+		}
+	}
+	return false;
+}
+
+/* Write the characters of canvas without colour, a line per row. */
+static void snap_write_text(FILE *out, caca_canvas_t * canvas)
+{
+	int width = caca_get_canvas_width(canvas);
+	int height = caca_get_canvas_height(canvas);
+	char utf8[8];
+	int x, y;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t ch = caca_get_char(canvas, x, y);
+			if (ch == CACA_MAGIC_FULLWIDTH) {
+				continue;
+			}
+			fwrite(utf8, 1, caca_utf32_to_utf8(utf8, ch), out);
+		}
+		fputc('\n', out);
+	}
+}
+
+/* Render the latest frame-buffer and write it out as the frame of number. Return false only on failure. */
+static bool snap_frame(struct snap_settings *s, struct viewer *v, FILE *out,
+		       int num)
+{
+	struct viewer_scene scene;
+	struct perf_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	viewer_scene_of(v, &scene);
+	if (!viewer_render(v, &scene, false, v->frame, &frame)) {
+		return false;
+	}
+	long long begin = perf_now_usec();
+	if (s->format == SNAP_FORMAT_ANSI) {
+		size_t len;
+		void *buf = caca_export_canvas_to_memory(v->frame, "utf8", &len);
+		if (!buf) {
+			fprintf(stderr, "Failed to export caca canvas\n");
+			return false;
+		}
+		/* Frames of a stream overwrite each other on terminal */
+		if (s->interval_msec > 0) {
+			fputs("\033[H", out);
+		}
+		fwrite(buf, 1, len, out);
+		free(buf);
+	} else {
+		if (s->interval_msec > 0 && num > 0) {
+			fputs("\f\n", out);
+		}
+		snap_write_text(out, v->frame);
+	}
+	if (fflush(out) != 0 || ferror(out)) {
+		fprintf(stderr, "Failed to write snapshot\n");
+		return false;
+	}
+	frame.output_usec = perf_now_usec() - begin;
+	perf_frame_done(&v->perf, &frame);
+	return true;
+}
+
+bool snap_run(struct snap_settings *s, struct opt *opt, struct vnc *vnc,
+	      struct pool *pool)
+{
+	FILE *out = stdout;
+	if (strcmp(s->path, "-") != 0) {
+		out = fopen(s->path, "w");
+		if (!out) {
+			fprintf(stderr, "Failed to open snapshot file %s\n",
+				s->path);
+			return false;
+		}
+	}
+	struct viewer v;
+	if (!viewer_init_headless(&v, vnc, opt, pool, s->width, s->height,
+				  s->width * SNAP_CH_PX_WIDTH,
+				  s->height * SNAP_CH_PX_HEIGHT)) {
+		if (out != stdout) {
+			fclose(out);
+		}
+		return false;
+	}
+	bool ok = true;
+	/* Client asked for the entire frame-buffer while connecting, the first update answers it */
+	if (!snap_wait_update(vnc, perf_now_usec() +
+			      SNAP_FIRST_UPDATE_TIMEOUT_USEC)) {
+		fprintf(stderr,
+			"Server has not sent frame-buffer (connection lost or timed out)\n");
+		ok = false;
+	}
+	long long next = perf_now_usec();
+	int num;
+	for (num = 0; ok; num++) {
+		ok = snap_frame(s, &v, out, num);
+		if (s->interval_msec == 0 || (s->count > 0 && num + 1 >= s->count)
+		    || !vnc->connected) {
+			break;
+		}
+		/* Keep the pace of stream even if a frame took longer than usual */
+		next += s->interval_msec * 1000LL;
+		long long now = perf_now_usec();
+		if (next > now) {
+			usleep(next - now);
+		} else {
+			next = now;
+		}
+	}
+	viewer_terminate(&v);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return ok;
+}
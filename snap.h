@@ -0,0 +1,47 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define SNAP_DEFAULT_WIDTH 80
+#define SNAP_DEFAULT_HEIGHT 24
+#define SNAP_FIRST_UPDATE_TIMEOUT_USEC 10000000	/* Give up if server has not sent the first update by then */
+/* Characters are taken to be twice as tall as wide, which is close enough for most terminal fonts. */
+#define SNAP_CH_PX_WIDTH 8
+#define SNAP_CH_PX_HEIGHT 16
+
+/* How rendered frames are written out. */
+enum snap_format {
+	SNAP_FORMAT_ANSI,	/* UTF-8 characters with ANSI colour escape sequences */
+	SNAP_FORMAT_TEXT	/* UTF-8 characters without colour */
+};
+
+/* What headless mode renders and where it goes, see snap_run. */
+struct snap_settings {
+	/* Write frames to this file, "-" is standard output, NULL if headless mode is not wanted */
+	const char *path;
+	int width, height;
+	enum snap_format format;
+	/* Stream a frame every interval, 0 means a single snapshot */
+	int interval_msec;
+	/* Stop streaming after this many frames, 0 means until connection is lost */
+	int count;
+};
+
+struct opt;
+struct pool;
+struct vnc;
+
+/*
+ * Render the connected frame-buffer without terminal. Wait for the first frame-buffer update, which
+ * covers the whole frame-buffer, render it at the size of settings and write it out. In streaming
+ * mode, keep rendering the latest frame-buffer and writing it out at the interval. In a stream, an
+ * ANSI frame begins by moving cursor to the top left, and text frames are separated by form feed.
+ * Return false only on failure.
+ */
+bool snap_run(struct snap_settings *s, struct opt *opt, struct vnc *vnc,
+	      struct pool *pool);
+
+#endif
@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "term.h"
+
+/* ANSI colour number of each caca colour, caca orders them by BGR and ANSI orders them by RGB. */
+static const int term_ansi_of_caca[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+/* Intensity of the 6 levels of each channel in the colour cube of 256-colour terminals. */
+static const int term_cube_levels[6] = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+
+/* The nearest 256-colour index of every 12-bit RGB colour, built once on first use. */
+static uint8_t term_256_of_rgb12[1 << 12];
+static pthread_once_t term_256_once = PTHREAD_ONCE_INIT;
+
+/* Return the weighted distance between two 8-bit RGB colours. */
+static int term_rgb_dist(int r1, int g1, int b1, int r2, int g2, int b2)
+{
+	/* Eyes are most sensitive to green and least sensitive to blue */
+	return 3 * (r1 - r2) * (r1 - r2) + 6 * (g1 - g2) * (g1 - g2) +
+	    (b1 - b2) * (b1 - b2);
+}
+
+/*
+ * Find the nearest colour among the colour cube (16 - 231) and grey ramp (232 - 255) for every
+ * 12-bit RGB colour. The first 16 colours are left out as terminals differ in their actual RGB.
+ */
+static void term_build_256_table(void)
+{
+	int c, i;
+	for (c = 0; c < (1 << 12); c++) {
+		int r = ((c >> 8) & 15) * 17;
+		int g = ((c >> 4) & 15) * 17;
+		int b = (c & 15) * 17;
+		int best = 16, best_dist = -1;
+		int ri, gi, bi;
+		for (ri = 0; ri < 6; ri++) {
+			for (gi = 0; gi < 6; gi++) {
+				for (bi = 0; bi < 6; bi++) {
+					int dist = term_rgb_dist(r, g, b,
+								 term_cube_levels
+								 [ri],
+								 term_cube_levels
+								 [gi],
+								 term_cube_levels
+								 [bi]);
+					if (best_dist < 0 || dist < best_dist) {
+						best_dist = dist;
+						best = 16 + ri * 36 + gi * 6 + bi;
+					}
+				}
+			}
+		}
+		for (i = 0; i < 24; i++) {
+			int grey = 8 + i * 10;
+			int dist = term_rgb_dist(r, g, b, grey, grey, grey);
+			if (dist < best_dist) {
+				best_dist = dist;
+				best = 232 + i;
+			}
+		}
+		term_256_of_rgb12[c] = best;
+	}
+}
+
+/* Append bytes to the frame buffer. Return false only on failure. */
+static bool term_put(struct term *t, const char *data, size_t len)
+{
+	if (t->len + len > t->cap) {
+		size_t cap = t->cap * 2 + len + 4096;
+		char *buf = realloc(t->buf, cap);
+		if (!buf) {
+			return false;
+		}
+		t->buf = buf;
+		t->cap = cap;
+	}
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+	return true;
+}
+
+/* Append a formatted escape sequence to the frame buffer. */
+static bool term_printf(struct term *t, const char *fmt, ...)
+{
+	char seq[64];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(seq, sizeof(seq), fmt, ap);
+	va_end(ap);
+	return term_put(t, seq, len);
+}
+
+/* Write the entire frame buffer to terminal. Return false only on IO failure. */
+static bool term_flush(struct term *t)
+{
+	size_t off = 0;
+	while (off < t->len) {
+		ssize_t n = write(t->fd, t->buf + off, t->len - off);
+		t->frame_writes++;
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return false;
+		}
+		off += n;
+	}
+	t->frame_bytes += t->len;
+	t->len = 0;
+	return true;
+}
+
+enum term_colours term_detect_colours(void)
+{
+	const char *colorterm = getenv("COLORTERM");
+	const char *term = getenv("TERM");
+	if (colorterm != NULL && (strstr(colorterm, "truecolor") != NULL
+				  || strstr(colorterm, "24bit") != NULL)) {
+		return TERM_COLOURS_TRUE;
+	}
+	if (term != NULL && strstr(term, "-direct") != NULL) {
+		return TERM_COLOURS_TRUE;
+	}
+	if (term != NULL && strstr(term, "256color") != NULL) {
+		return TERM_COLOURS_256;
+	}
+	return TERM_COLOURS_16;
+}
+
+bool term_init(struct term *t, int fd, enum term_colours colours)
+{
+	memset(t, 0, sizeof(struct term));
+	t->fd = fd;
+	t->colours = colours;
+	if (t->colours == TERM_COLOURS_AUTO) {
+		t->colours = term_detect_colours();
+	}
+	pthread_once(&term_256_once, term_build_256_table);
+	/* Hide cursor */
+	if (!term_put(t, "\033[?25l", 6)) {
+		return false;
+	}
+	/* Without terminal, the sequence is the beginning of the first composed frame */
+	return t->fd == -1 || term_flush(t);
+}
+
+void term_invalidate(struct term *t)
+{
+	t->valid = false;
+}
+
+/* Return true only if the foreground or background colour of attribute is one of the 16 ANSI colours, rather than ARGB. */
+static bool term_is_ansi(uint32_t attr, bool fg)
+{
+	/* libcaca keeps a colour in 14 bits, an ANSI colour is its index with 0x40 set */
+	uint32_t colour = fg ? (attr >> 4) & 0x3fff : attr >> 18;
+	return colour >= 0x40 && colour < 0x50;
+}
+
+/*
+ * Append SGR sequence of the foreground or background colour of attribute. ANSI colours, and every
+ * colour on terminals of 16 colours, get the short ANSI codes (nearest ANSI colour for ARGB), which
+ * also keep the palette of terminal. Only ARGB colours get the RGB colour of attribute elsewhere.
+ */
+static void term_put_colour(struct term *t, uint32_t attr, bool fg)
+{
+	uint8_t colour =
+	    fg ? caca_attr_to_ansi_fg(attr) : caca_attr_to_ansi_bg(attr);
+	uint16_t rgb12 =
+	    fg ? caca_attr_to_rgb12_fg(attr) : caca_attr_to_rgb12_bg(attr);
+	if (colour >= 16) {
+		/* Default or transparent */
+		term_put(t, fg ? ";39" : ";49", 3);
+	} else if (t->colours == TERM_COLOURS_16 || term_is_ansi(attr, fg)) {
+		if (colour >= 8) {
+			term_printf(t, ";%d", (fg ? 90 : 100) +
+				    term_ansi_of_caca[colour - 8]);
+		} else {
+			term_printf(t, ";%d", (fg ? 30 : 40) +
+				    term_ansi_of_caca[colour]);
+		}
+	} else if (t->colours == TERM_COLOURS_TRUE) {
+		term_printf(t, ";%d;2;%d;%d;%d", fg ? 38 : 48,
+			    ((rgb12 >> 8) & 15) * 17, ((rgb12 >> 4) & 15) * 17,
+			    (rgb12 & 15) * 17);
+	} else {
+		term_printf(t, ";%d;5;%d", fg ? 38 : 48,
+			    term_256_of_rgb12[rgb12 & 0xfff]);
+	}
+}
+
+/* Append SGR sequence that switches to the attribute. */
+static void term_put_attr(struct term *t, uint32_t attr)
+{
+	term_put(t, "\033[0", 3);
+	term_put_colour(t, attr, true);
+	term_put_colour(t, attr, false);
+	term_put(t, "m", 1);
+	t->cur_attr = attr;
+}
+
+/* Append a character at the position, moving cursor and switching attribute only if necessary. */
+static void term_put_cell(struct term *t, int x, int y, uint32_t ch,
+			  uint32_t attr)
+{
+	if (ch == CACA_MAGIC_FULLWIDTH) {
+		/* Right half of a full-width character is already drawn */
+		return;
+	}
+	if (!t->cur_known || t->cur_x != x || t->cur_y != y) {
+		term_printf(t, "\033[%d;%dH", y + 1, x + 1);
+	}
+	if (!t->cur_known || t->cur_attr != attr) {
+		term_put_attr(t, attr);
+	}
+	char utf8[8];
+	size_t len = caca_utf32_to_utf8(utf8, ch);
+	term_put(t, utf8, len);
+	t->cur_known = true;
+	t->cur_x = x + 1;
+	t->cur_y = y;
+	if (caca_utf32_is_fullwidth(ch)) {
+		t->cur_x++;
+	}
+}
+
+/* Make the remembered terminal content as large as the canvas. Return false only on failure. */
+static bool term_resize(struct term *t, int width, int height)
+{
+	if (t->chars != NULL && width == t->width && height == t->height) {
+		return true;
+	}
+	free(t->chars);
+	free(t->attrs);
+	t->chars = calloc((size_t)width * height + 1, sizeof(uint32_t));
+	t->attrs = calloc((size_t)width * height + 1, sizeof(uint32_t));
+	t->width = width;
+	t->height = height;
+	t->valid = false;
+	return t->chars != NULL && t->attrs != NULL;
+}
+
+bool term_compose(struct term *t, caca_canvas_t * canvas)
+{
+	int width = caca_get_canvas_width(canvas);
+	int height = caca_get_canvas_height(canvas);
+	const uint32_t *chars = caca_get_canvas_chars(canvas);
+	const uint32_t *attrs = caca_get_canvas_attrs(canvas);
+	if (!term_resize(t, width, height)) {
+		return false;
+	}
+	/* Cursor position and attribute are unknown after somebody else has drawn on terminal */
+	if (!t->valid) {
+		t->cur_known = false;
+		term_put(t, "\033[0m\033[2J", 8);
+	}
+	int x, y;
+	for (y = 0; y < height; y++) {
+		size_t row = (size_t)y * width;
+		if (t->valid
+		    && memcmp(chars + row, t->chars + row,
+			      width * sizeof(uint32_t)) == 0
+		    && memcmp(attrs + row, t->attrs + row,
+			      width * sizeof(uint32_t)) == 0) {
+			continue;
+		}
+		for (x = 0; x < width; x++) {
+			size_t i = row + x;
+			if (t->valid && chars[i] == t->chars[i]
+			    && attrs[i] == t->attrs[i]) {
+				continue;
+			}
+			/*
+			 * Cursor is just behind a few unchanged characters, writing them
+			 * again is cheaper than moving cursor past them.
+			 */
+			if (t->cur_known && t->cur_y == y && t->cur_x < x
+			    && x - t->cur_x <= TERM_MAX_GAP) {
+				int gap;
+				for (gap = t->cur_x; gap < x; gap++) {
+					term_put_cell(t, gap, y, chars[row + gap],
+						      attrs[row + gap]);
+				}
+			}
+			term_put_cell(t, x, y, chars[i], attrs[i]);
+			t->chars[i] = chars[i];
+			t->attrs[i] = attrs[i];
+		}
+	}
+	t->valid = true;
+	return true;
+}
+
+bool term_refresh(struct term *t, caca_canvas_t * canvas)
+{
+	t->frame_bytes = 0;
+	t->frame_writes = 0;
+	if (!term_compose(t, canvas)) {
+		return false;
+	}
+	if (t->len > 0 && !term_flush(t)) {
+		return false;
+	}
+	t->frames++;
+	t->total_bytes += t->frame_bytes;
+	t->total_writes += t->frame_writes;
+	return true;
+}
+
+void term_destroy(struct term *t)
+{
+	/* Restore attribute and show cursor */
+	t->len = 0;
+	term_put(t, "\033[0m\033[?25h", 10);
+	if (t->fd != -1) {
+		term_flush(t);
+	}
+	free(t->chars);
+	free(t->attrs);
+	free(t->buf);
+	memset(t, 0, sizeof(struct term));
+}
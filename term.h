@@ -0,0 +1,66 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the viewer draws its canvas. */
+enum term_output {
+	TERM_OUTPUT_NCURSES,	/* The ncurses driver of libcaca */
+	TERM_OUTPUT_NATIVE	/* Native terminal output, see struct term */
+};
+
+/* Colours understood by the terminal. */
+enum term_colours {
+	TERM_COLOURS_AUTO,	/* Detect from environment variables COLORTERM and TERM */
+	TERM_COLOURS_16,
+	TERM_COLOURS_256,
+	TERM_COLOURS_TRUE	/* 24-bit colours */
+};
+
+/* Unchanged characters in between changed ones up to this many are written out, as it is cheaper than moving cursor. */
+#define TERM_MAX_GAP 4
+
+/*
+ * Native terminal output that remembers the characters last written to terminal, and writes
+ * only the changed ones using ANSI escape sequences. A frame goes out in a single buffered write.
+ */
+struct term {
+	int fd;
+	enum term_colours colours;
+	/* Characters and attributes on terminal */
+	int width, height;
+	uint32_t *chars, *attrs;
+	bool valid;
+
+	/* Escape sequences and text of the frame being composed */
+	char *buf;
+	size_t len, cap;
+	int cur_x, cur_y;
+	uint32_t cur_attr;
+	bool cur_known;
+
+	/* Output of the latest frame and the total of all frames */
+	size_t frame_bytes, frame_writes;
+	unsigned long frames, total_bytes, total_writes;
+};
+
+/* Return the colours understood by the terminal, judging by environment variables. */
+enum term_colours term_detect_colours(void);
+/*
+ * Initialise output of the colours to the terminal file descriptor. Without terminal (fd is -1),
+ * frames are only composed for the caller to take from buf. Return false only on failure.
+ */
+bool term_init(struct term *t, int fd, enum term_colours colours);
+/* Forget what is on terminal, the next refresh repaints all characters. */
+void term_invalidate(struct term *t);
+/* Append escape sequences and text of the characters of canvas that differ from terminal to buf. Return false only on failure. */
+bool term_compose(struct term *t, caca_canvas_t * canvas);
+/* Write characters of canvas that differ from terminal. Return false only on IO failure. */
+bool term_refresh(struct term *t, caca_canvas_t * canvas);
+/* Release all resources held by terminal output and restore cursor. */
+void term_destroy(struct term *t);
+
+#endif
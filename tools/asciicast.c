@@ -0,0 +1,119 @@
+/*
+ * Convert a cast recorded by "headmore -cast" into an asciicast (version 2) stream on standard output,
+ * for asciinema and its web player. Every frame becomes an output event made of the escape sequences
+ * that native terminal output of headmore would have written for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cast.h"
+#include "term.h"
+
+/* Write the bytes as the contents of a JSON string. */
+static void asciicast_put_json(FILE *out, const char *data, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char ch = data[i];
+		if (ch == '"' || ch == '\\') {
+			fputc('\\', out);
+			fputc(ch, out);
+		} else if (ch < 0x20 || ch == 0x7f) {
+			fprintf(out, "\\u%04x", ch);
+		} else {
+			/* UTF-8 of the characters passes through as it is */
+			fputc(ch, out);
+		}
+	}
+}
+
+static void asciicast_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-colours 16|256|truecolor] cast > session.cast\n"
+		"  -colours C   Colours of the terminal that plays the asciicast (default truecolor)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	enum term_colours colours = TERM_COLOURS_TRUE;
+	const char *path = NULL;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-colours") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "16") == 0) {
+				colours = TERM_COLOURS_16;
+			} else if (strcmp(argv[i], "256") == 0) {
+				colours = TERM_COLOURS_256;
+			} else if (strcmp(argv[i], "truecolor") == 0) {
+				colours = TERM_COLOURS_TRUE;
+			} else {
+				asciicast_usage(argv[0]);
+				return 1;
+			}
+		} else if (path == NULL) {
+			path = argv[i];
+		} else {
+			asciicast_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (path == NULL) {
+		asciicast_usage(argv[0]);
+		return 1;
+	}
+	struct cast_reader reader;
+	struct term term;
+	if (!cast_reader_open(&reader, path)) {
+		return 1;
+	}
+	caca_canvas_t *canvas = caca_create_canvas(0, 0);
+	if (!canvas || !term_init(&term, -1, colours)) {
+		fprintf(stderr, "Failed to create caca canvas\n");
+		return 1;
+	}
+	/* Header of asciicast carries the size of the first frame, later sizes come in resize events */
+	long long delay, usec = 0;
+	unsigned long frames = 0;
+	int width = 0, height = 0;
+	while (cast_reader_next(&reader, canvas, &delay)) {
+		usec += delay;
+		if (frames == 0) {
+			printf("{\"version\": 2, \"width\": %d, \"height\": %d, \"env\": {\"TERM\": \"%s\"}}\n",
+			       reader.width, reader.height,
+			       (colours == TERM_COLOURS_16) ? "xterm" :
+			       "xterm-256color");
+		} else if (reader.width != width || reader.height != height) {
+			printf("[%lld.%06lld, \"r\", \"%dx%d\"]\n",
+			       usec / 1000000, usec % 1000000, reader.width,
+			       reader.height);
+		}
+		width = reader.width;
+		height = reader.height;
+		frames++;
+		if (!term_compose(&term, canvas)) {
+			fprintf(stderr, "Failed to compose frame %lu\n", frames);
+			return 1;
+		}
+		if (term.len == 0) {
+			continue;
+		}
+		printf("[%lld.%06lld, \"o\", \"", usec / 1000000, usec % 1000000);
+		asciicast_put_json(stdout, term.buf, term.len);
+		printf("\"]\n");
+		term.len = 0;
+	}
+	bool failed = reader.failed;
+	if (failed) {
+		fprintf(stderr, "%s is damaged after frame %lu\n", path, frames);
+	}
+	cast_reader_close(&reader);
+	term_destroy(&term);
+	caca_free_canvas(canvas);
+	if (fflush(stdout) != 0) {
+		fprintf(stderr, "Failed to write asciicast\n");
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * A VNC server of synthetic workloads for testing headmore on one computer. It measures the latency
+ * between a key or pointer event arriving from client and the frame-buffer update that answers it
+ * being sent back, and the sustained update throughput, and reports them every few seconds.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <rfb/rfb.h>
+
+#define LOADGEN_DEFAULT_WIDTH 1280
+#define LOADGEN_DEFAULT_HEIGHT 800
+#define LOADGEN_DEFAULT_FPS 30
+#define LOADGEN_REPORT_USEC 5000000
+/* Every input is answered by repainting this square at the top left corner */
+#define LOADGEN_ANSWER_SIZE 16
+/* Size of a character of the scrolling text */
+#define LOADGEN_CH_WIDTH 8
+#define LOADGEN_CH_HEIGHT 16
+/* Size of the blinking region */
+#define LOADGEN_BLINK_SIZE 32
+/* Inputs waiting for an answer, the oldest ones are dropped beyond this many */
+#define LOADGEN_MAX_PENDING 256
+
+/* What the desktop shows. */
+enum loadgen_workload {
+	LOADGEN_STATIC,		/* Nothing changes unless client sends input */
+	LOADGEN_TEXT,		/* A terminal scrolls one line of text per frame */
+	LOADGEN_NOISE,		/* Every pixel changes every frame, like a video */
+	LOADGEN_BLINK		/* A small region blinks every frame */
+};
+
+/* Names of workloads, in the order of enum loadgen_workload. */
+static const char *const loadgen_workloads[] =
+    { "static", "text", "noise", "blink", NULL };
+
+/* Latency statistics of one kind of input over a report interval. */
+struct loadgen_latency {
+	unsigned long count;
+	long long sum_usec, max_usec;
+};
+
+struct loadgen {
+	rfbScreenInfoPtr screen;
+	enum loadgen_workload workload;
+	int fps;
+	uint32_t *fb;
+	uint32_t rand_state;
+	unsigned long frame;
+	/* Arrival time of inputs not yet answered, key inputs are marked */
+	long long pending_usec[LOADGEN_MAX_PENDING];
+	bool pending_key[LOADGEN_MAX_PENDING];
+	int num_pending;
+	/* Counters of the current report interval */
+	struct loadgen_latency key_latency, ptr_latency;
+	unsigned long updates, frames;
+	unsigned long long bytes;
+	long long report_start_usec;
+};
+
+/* Bytes sent to a client so far, kept in its client data. */
+struct loadgen_client {
+	int sent_bytes;
+};
+
+static struct loadgen gen;
+static volatile sig_atomic_t loadgen_quit;
+
+static long long loadgen_now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Return a pseudo random number, the sequence is the same in every run. */
+static uint32_t loadgen_rand(struct loadgen *g)
+{
+	uint32_t x = g->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	g->rand_state = x;
+	return x;
+}
+
+/* Fill a rectangle of frame-buffer with the colour, without marking it modified. */
+static void loadgen_fill(struct loadgen *g, int x, int y, int w, int h,
+			 uint32_t colour)
+{
+	int i, j;
+	for (j = y; j < y + h && j < g->screen->height; j++) {
+		for (i = x; i < x + w && i < g->screen->width; i++) {
+			g->fb[j * g->screen->width + i] = colour;
+		}
+	}
+}
+
+/* Paint a gradient desktop. */
+static void loadgen_paint_desktop(struct loadgen *g)
+{
+	int x, y, w = g->screen->width, h = g->screen->height;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			g->fb[y * w + x] =
+			    (x * 255 / w) | (y * 255 / h) << 8 | 0x60 << 16;
+		}
+	}
+}
+
+/* Draw a line of random glyphs at the bottom of the text area, each glyph is a random dot pattern. */
+static void loadgen_draw_text_line(struct loadgen *g, int y)
+{
+	int cols = g->screen->width / LOADGEN_CH_WIDTH;
+	int col, row, len = loadgen_rand(g) % cols;
+	loadgen_fill(g, 0, y, g->screen->width, LOADGEN_CH_HEIGHT, 0);
+	for (col = 0; col < len; col++) {
+		for (row = 2; row < LOADGEN_CH_HEIGHT - 2; row++) {
+			uint32_t bits = loadgen_rand(g);
+			int i;
+			for (i = 1; i < LOADGEN_CH_WIDTH - 1; i++) {
+				if (bits & (1 << i)) {
+					g->fb[(y + row) * g->screen->width +
+					      col * LOADGEN_CH_WIDTH + i] =
+					    0x00c0c0c0;
+				}
+			}
+		}
+	}
+}
+
+/* Advance the workload by a frame, and mark what changed. */
+static void loadgen_next_frame(struct loadgen *g)
+{
+	int w = g->screen->width, h = g->screen->height;
+	int x, y;
+	g->frame++;
+	g->frames++;
+	switch (g->workload) {
+	case LOADGEN_TEXT:
+		h -= h % LOADGEN_CH_HEIGHT;
+		/* Scroll by copying, so that server may send it as CopyRect */
+		rfbDoCopyRect(g->screen, 0, 0, w, h - LOADGEN_CH_HEIGHT, 0,
+			      -LOADGEN_CH_HEIGHT);
+		loadgen_draw_text_line(g, h - LOADGEN_CH_HEIGHT);
+		rfbMarkRectAsModified(g->screen, 0, h - LOADGEN_CH_HEIGHT, w, h);
+		break;
+	case LOADGEN_NOISE:
+		for (y = 0; y < h; y++) {
+			for (x = 0; x < w; x++) {
+				g->fb[y * w + x] = loadgen_rand(g) & 0x00ffffff;
+			}
+		}
+		rfbMarkRectAsModified(g->screen, 0, 0, w, h);
+		break;
+	case LOADGEN_BLINK:
+		x = (w - LOADGEN_BLINK_SIZE) / 2;
+		y = (h - LOADGEN_BLINK_SIZE) / 2;
+		loadgen_fill(g, x, y, LOADGEN_BLINK_SIZE, LOADGEN_BLINK_SIZE,
+			     (g->frame & 1) ? 0x00ffffff : 0x00000000);
+		rfbMarkRectAsModified(g->screen, x, y, x + LOADGEN_BLINK_SIZE,
+				      y + LOADGEN_BLINK_SIZE);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Remember the arrival of an input, and repaint the answer square in a colour of its own. */
+static void loadgen_input(struct loadgen *g, bool key, uint32_t colour)
+{
+	if (g->num_pending == LOADGEN_MAX_PENDING) {
+		memmove(g->pending_usec, g->pending_usec + 1,
+			(LOADGEN_MAX_PENDING - 1) * sizeof(long long));
+		memmove(g->pending_key, g->pending_key + 1,
+			(LOADGEN_MAX_PENDING - 1) * sizeof(bool));
+		g->num_pending--;
+	}
+	g->pending_usec[g->num_pending] = loadgen_now_usec();
+	g->pending_key[g->num_pending] = key;
+	g->num_pending++;
+	loadgen_fill(g, 0, 0, LOADGEN_ANSWER_SIZE, LOADGEN_ANSWER_SIZE,
+		     colour & 0x00ffffff);
+	rfbMarkRectAsModified(g->screen, 0, 0, LOADGEN_ANSWER_SIZE,
+			      LOADGEN_ANSWER_SIZE);
+}
+
+static void loadgen_kbd_event(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+{
+	if (down) {
+		loadgen_input(&gen, true, key * 2654435761u);
+	}
+}
+
+static void loadgen_ptr_event(int button_mask, int x, int y, rfbClientPtr cl)
+{
+	loadgen_input(&gen, false, (x * 31 + y) * 2654435761u + button_mask);
+	rfbDefaultPtrAddEvent(button_mask, x, y, cl);
+}
+
+/* Count an update sent to client, it answers all pending inputs. */
+static void loadgen_update_sent(rfbClientPtr cl, int result)
+{
+	struct loadgen *g = &gen;
+	struct loadgen_client *c = cl->clientData;
+	long long now = loadgen_now_usec();
+	int i;
+	g->updates++;
+	if (c != NULL) {
+		int sent = rfbStatGetSentBytes(cl);
+		g->bytes += sent - c->sent_bytes;
+		c->sent_bytes = sent;
+	}
+	for (i = 0; i < g->num_pending; i++) {
+		struct loadgen_latency *l =
+		    g->pending_key[i] ? &g->key_latency : &g->ptr_latency;
+		long long usec = now - g->pending_usec[i];
+		l->count++;
+		l->sum_usec += usec;
+		if (usec > l->max_usec) {
+			l->max_usec = usec;
+		}
+	}
+	g->num_pending = 0;
+}
+
+static void loadgen_client_gone(rfbClientPtr cl)
+{
+	free(cl->clientData);
+	cl->clientData = NULL;
+	printf("Client disconnected\n");
+}
+
+static enum rfbNewClientAction loadgen_new_client(rfbClientPtr cl)
+{
+	cl->clientData = calloc(1, sizeof(struct loadgen_client));
+	cl->clientGoneHook = loadgen_client_gone;
+	printf("Client connected\n");
+	return RFB_CLIENT_ACCEPT;
+}
+
+/* Print the latency of a kind of input. */
+static void loadgen_print_latency(const char *name, struct loadgen_latency *l)
+{
+	if (l->count == 0) {
+		printf("  %s -", name);
+	} else {
+		printf("  %s %lu avg %.1fms max %.1fms", name, l->count,
+		       l->sum_usec / 1000.0 / l->count, l->max_usec / 1000.0);
+	}
+}
+
+/* Print the counters of the current interval, and begin a new interval. */
+static void loadgen_report(struct loadgen *g)
+{
+	long long now = loadgen_now_usec();
+	double secs = (now - g->report_start_usec) / 1e6;
+	printf("%.1f frames/s  %.1f updates/s  %.1fKB/s sent ",
+	       g->frames / secs, g->updates / secs, g->bytes / 1024.0 / secs);
+	loadgen_print_latency("key", &g->key_latency);
+	loadgen_print_latency("pointer", &g->ptr_latency);
+	printf("\n");
+	fflush(stdout);
+	memset(&g->key_latency, 0, sizeof(g->key_latency));
+	memset(&g->ptr_latency, 0, sizeof(g->ptr_latency));
+	g->frames = 0;
+	g->updates = 0;
+	g->bytes = 0;
+	g->report_start_usec = now;
+}
+
+static void loadgen_stop(int sig)
+{
+	loadgen_quit = 1;
+}
+
+static void loadgen_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -workload W  static (default), text, noise, or blink\n"
+		"  -size WxH    Size of frame-buffer (default %dx%d)\n"
+		"  -fps N       Frames a second of the workload (default %d)\n"
+		"LibVNCServer options such as -rfbport are also accepted.\n",
+		prog, LOADGEN_DEFAULT_WIDTH, LOADGEN_DEFAULT_HEIGHT,
+		LOADGEN_DEFAULT_FPS);
+}
+
+int main(int argc, char **argv)
+{
+	struct loadgen *g = &gen;
+	int width = LOADGEN_DEFAULT_WIDTH, height = LOADGEN_DEFAULT_HEIGHT;
+	int i = 1, j;
+	memset(g, 0, sizeof(struct loadgen));
+	g->fps = LOADGEN_DEFAULT_FPS;
+	g->rand_state = 2463534242u;
+	while (i < argc) {
+		if (i + 1 < argc && strcmp(argv[i], "-workload") == 0) {
+			for (j = 0; loadgen_workloads[j] != NULL; j++) {
+				if (strcmp(argv[i + 1], loadgen_workloads[j]) ==
+				    0) {
+					break;
+				}
+			}
+			if (loadgen_workloads[j] == NULL) {
+				loadgen_usage(argv[0]);
+				return 1;
+			}
+			g->workload = j;
+		} else if (i + 1 < argc && strcmp(argv[i], "-size") == 0) {
+			if (sscanf(argv[i + 1], "%dx%d", &width, &height) != 2
+			    || width < LOADGEN_BLINK_SIZE
+			    || height < LOADGEN_BLINK_SIZE) {
+				loadgen_usage(argv[0]);
+				return 1;
+			}
+		} else if (i + 1 < argc && strcmp(argv[i], "-fps") == 0) {
+			g->fps = atoi(argv[i + 1]);
+			if (g->fps < 1 || g->fps > 1000) {
+				loadgen_usage(argv[0]);
+				return 1;
+			}
+		} else {
+			i++;
+			continue;
+		}
+		/* Leave the remaining options to LibVNCServer */
+		memmove(argv + i, argv + i + 2,
+			(argc - i - 1) * sizeof(char *));
+		argc -= 2;
+	}
+	g->screen = rfbGetScreen(&argc, argv, width, height, 8, 3, 4);
+	if (!g->screen) {
+		fprintf(stderr, "Failed to create VNC server\n");
+		return 1;
+	}
+	g->fb = calloc((size_t)width * height, sizeof(uint32_t));
+	if (!g->fb) {
+		fprintf(stderr, "Failed to allocate frame-buffer\n");
+		return 1;
+	}
+	g->screen->frameBuffer = (char *)g->fb;
+	g->screen->desktopName = loadgen_workloads[g->workload];
+	g->screen->alwaysShared = TRUE;
+	g->screen->kbdAddEvent = loadgen_kbd_event;
+	g->screen->ptrAddEvent = loadgen_ptr_event;
+	g->screen->newClientHook = loadgen_new_client;
+	g->screen->displayFinishedHook = loadgen_update_sent;
+	loadgen_paint_desktop(g);
+	rfbInitServer(g->screen);
+	signal(SIGINT, loadgen_stop);
+	signal(SIGTERM, loadgen_stop);
+	printf("Serving %s workload of %dx%d at %d frames/s on port %d\n",
+	       loadgen_workloads[g->workload], width, height, g->fps,
+	       g->screen->port);
+	fflush(stdout);
+	long long frame_intvl = 1000000 / g->fps;
+	long long next_frame = loadgen_now_usec() + frame_intvl;
+	g->report_start_usec = loadgen_now_usec();
+	while (!loadgen_quit && rfbIsActive(g->screen)) {
+		long long now = loadgen_now_usec();
+		if (now >= next_frame) {
+			loadgen_next_frame(g);
+			next_frame += frame_intvl;
+			/* Do not try to catch up after falling behind */
+			if (next_frame < now) {
+				next_frame = now + frame_intvl;
+			}
+		}
+		if (now - g->report_start_usec >= LOADGEN_REPORT_USEC) {
+			loadgen_report(g);
+		}
+		/* Handle client messages and send updates until the next frame is due */
+		long long wait = next_frame - loadgen_now_usec();
+		rfbProcessEvents(g->screen, wait > 0 ? wait : 0);
+	}
+	loadgen_report(g);
+	rfbShutdownServer(g->screen, TRUE);
+	rfbScreenCleanup(g->screen);
+	free(g->fb);
+	return 0;
+}
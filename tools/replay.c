@@ -0,0 +1,168 @@
+/*
+ * Replay a session recorded by "headmore -record" through the viewer, without network or terminal,
+ * and report how fast it was rendered. The same recording always feeds the same server messages
+ * to the same pipeline, so that render changes can be compared on the same workloads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include "opt.h"
+#include "pool.h"
+#include "rec.h"
+#include "vnc.h"
+#include "viewer.h"
+
+/* Size of the off-screen canvas in characters, unless CACA_GEOMETRY says otherwise. */
+#define REPLAY_DEFAULT_GEOMETRY "200x60"
+
+/* Time taken to render every frame, in microseconds. */
+struct replay_frames {
+	long long *usec;
+	size_t num, cap;
+};
+
+/* Remember the time taken to render a frame. Return false only on failure. */
+static bool replay_add_frame(struct replay_frames *f, long long usec)
+{
+	if (f->num == f->cap) {
+		size_t cap = f->cap ? f->cap * 2 : 1024;
+		long long *grown = realloc(f->usec, cap * sizeof(long long));
+		if (!grown) {
+			return false;
+		}
+		f->usec = grown;
+		f->cap = cap;
+	}
+	f->usec[f->num++] = usec;
+	return true;
+}
+
+static int replay_cmp_usec(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Return the percentile of frame times, which must be sorted. */
+static double replay_percentile_msec(struct replay_frames *f, int pct)
+{
+	if (f->num == 0) {
+		return 0;
+	}
+	return f->usec[(f->num - 1) * pct / 100] / 1000.0;
+}
+
+static void replay_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-pace fast|realtime] [options] recording\n"
+		"  -pace P      fast (default) replays as fast as viewer keeps up, realtime at the recorded pace\n"
+		"Rendering options of headmore such as -renderer, -threads, and -output are also accepted.\n",
+		prog);
+	opt_usage("headmore");
+}
+
+int main(int argc, char **argv)
+{
+	struct opt opt;
+	struct rec_replay replay;
+	struct pool pool;
+	struct vnc vnc;
+	struct viewer viewer;
+	struct replay_frames frames;
+	bool realtime = false;
+	int i;
+	for (i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-pace") == 0) {
+			if (strcmp(argv[i + 1], "realtime") == 0) {
+				realtime = true;
+			} else if (strcmp(argv[i + 1], "fast") != 0) {
+				replay_usage(argv[0]);
+				return 1;
+			}
+			memmove(argv + i, argv + i + 2,
+				(argc - i - 1) * sizeof(char *));
+			argc -= 2;
+			break;
+		}
+	}
+	if (!opt_parse(&opt, &argc, argv) || argc != 2) {
+		replay_usage(argv[0]);
+		return 1;
+	}
+	const char *path = argv[1];
+	/* Render into libcaca's null display, native output goes to nowhere */
+	opt.display_driver = "null";
+	setenv("CACA_GEOMETRY", REPLAY_DEFAULT_GEOMETRY, 0);
+	FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+	int devnull = open("/dev/null", O_WRONLY);
+	if (!report || devnull == -1 || dup2(devnull, STDOUT_FILENO) == -1) {
+		fprintf(stderr, "Failed to redirect standard output\n");
+		return 1;
+	}
+	close(devnull);
+	if (!rec_replay_start(&replay, path, realtime)) {
+		return 1;
+	}
+	/* Ask for the pixel depth of recording, server sends pixels in it */
+	opt.vnc.depth = replay.depth;
+	opt.vnc.record_path = NULL;
+	opt.vnc.replay_bytes = &replay.bytes;
+	/* Every replay runs the same pipeline, the governor would pick frame rate and dither by wall-clock timing */
+	opt.governor = false;
+	char *vnc_argv[] = { argv[0], replay.sock_path, NULL };
+	long long begin = perf_now_usec();
+	if (!vnc_init(&vnc, opt.vnc, 2, vnc_argv)) {
+		fprintf(stderr, "Failed to connect to replay server.\n");
+		return 1;
+	}
+	if (!pool_init(&pool, opt.threads)) {
+		fprintf(stderr, "Failed to start render threads.\n");
+		return 1;
+	}
+	if (!viewer_init(&viewer, &vnc, &opt, &pool)) {
+		fprintf(stderr, "Failed to initialise viewer display.\n");
+		return 1;
+	}
+	/* Render whenever there is a new snapshot, in real time no more often than the viewer would */
+	memset(&frames, 0, sizeof(frames));
+	long long last_frame = 0;
+	while (vnc.connected) {
+		struct pollfd pfd = { vnc_notify_fd(&vnc), POLLIN, 0 };
+		poll(&pfd, 1, VNC_POLL_TIMEOUT_USEC / 1000);
+		if (!vnc_take_notification(&vnc) || !vnc.connected) {
+			continue;
+		}
+		long long now = perf_now_usec();
+		if (realtime && now - last_frame < viewer.frame_intvl) {
+			usleep(viewer.frame_intvl - (now - last_frame));
+		}
+		last_frame = perf_now_usec();
+		viewer_redraw(&viewer);
+		if (!replay_add_frame(&frames, perf_now_usec() - last_frame)) {
+			fprintf(stderr, "Failed to allocate frame times.\n");
+			return 1;
+		}
+	}
+	double secs = (perf_now_usec() - begin) / 1e6;
+	unsigned long long bytes = replay.bytes;
+	viewer_terminate(&viewer);
+	pool_destroy(&pool);
+	vnc_destroy(&vnc);
+	rec_replay_stop(&replay);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	qsort(frames.usec, frames.num, sizeof(long long), replay_cmp_usec);
+	fprintf(report,
+		"%s (%s pace): %zu frames from %llu bytes in %.2fs, %.1f frames/s, frame time p50 %.2fms p99 %.2fms, peak RSS %ldKB\n",
+		path, realtime ? "realtime" : "fast", frames.num, bytes, secs,
+		frames.num / secs, replay_percentile_msec(&frames, 50),
+		replay_percentile_msec(&frames, 99), usage.ru_maxrss);
+	fclose(report);
+	free(frames.usec);
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include <string.h>
+#include "perf.h"
+#include "tune.h"
+
+/* Presets in the order of enum tune_mode, only LAN and WAN have one. */
+static const struct tune_preset tune_presets[] = {
+	{NULL, NULL, 0, 0, false},
+	/* Hextile and raw cost next to nothing to decode, and a terminal never needs lossless detail anyway */
+	{"lan", "copyrect hextile zlib raw", 1, 9, false},
+	/* Tight with low JPEG quality is by far the smallest, blocky JPEG artefacts vanish in dithering */
+	{"wan", "copyrect tight zrle ultra zlib hextile raw", 9, 2, true},
+};
+
+/* Put the preset into the application data of RFB client, it is sent to server along with pixel format. */
+static void tune_apply(struct tune *t, const struct tune_preset *preset,
+		       struct _rfbClient *conn)
+{
+	t->preset = preset;
+	conn->appData.encodingsString = preset->encodings;
+	conn->appData.compressLevel = preset->compress;
+	conn->appData.qualityLevel = preset->quality;
+	conn->appData.enableJPEG = preset->jpeg;
+}
+
+void tune_init(struct tune *t, enum tune_mode mode, struct _rfbClient *conn)
+{
+	memset(t, 0, sizeof(struct tune));
+	t->mode = mode;
+	t->switch_intvl_usec = TUNE_MIN_INTVL_USEC;
+	t->last_switch_usec = perf_now_usec();
+	if (mode == TUNE_LAN || mode == TUNE_WAN) {
+		tune_apply(t, &tune_presets[mode], conn);
+	} else if (mode == TUNE_AUTO) {
+		/* Begin conservatively, a slow link suffers more from the wrong choice than a fast one */
+		tune_apply(t, &tune_presets[TUNE_WAN], conn);
+	}
+}
+
+bool tune_measure(struct tune *t, struct _rfbClient *conn, long long cpu_usec,
+		  long long wait_usec)
+{
+	if (t->mode == TUNE_OFF) {
+		return true;
+	}
+	long long now = perf_now_usec();
+	/* Exponential moving average over roughly the latest 8 messages */
+	if (t->samples == 0) {
+		t->avg_cpu_usec = cpu_usec;
+		t->avg_wait_usec = wait_usec;
+	} else {
+		t->avg_cpu_usec += (cpu_usec - t->avg_cpu_usec) / 8;
+		t->avg_wait_usec += (wait_usec - t->avg_wait_usec) / 8;
+	}
+	t->samples++;
+	if (t->mode != TUNE_AUTO || t->samples < TUNE_MIN_SAMPLES
+	    || now - t->last_switch_usec < t->switch_intvl_usec) {
+		return true;
+	}
+	const struct tune_preset *next = t->preset;
+	if (t->preset == &tune_presets[TUNE_WAN]
+	    && t->avg_wait_usec < t->avg_cpu_usec) {
+		/* Network keeps up easily, decoding is the bottleneck */
+		next = &tune_presets[TUNE_LAN];
+	} else if (t->preset == &tune_presets[TUNE_LAN]
+		   && t->avg_wait_usec > TUNE_SLOW_WAIT_USEC
+		   && t->avg_wait_usec > 2 * t->avg_cpu_usec) {
+		/* Network is the bottleneck */
+		next = &tune_presets[TUNE_WAN];
+	}
+	if (next == t->preset) {
+		return true;
+	}
+	/* Switches are counted and reported on exit, the terminal belongs to viewer meanwhile */
+	tune_apply(t, next, conn);
+	t->samples = 0;
+	t->switches++;
+	t->last_switch_usec = now;
+	/* Back off, so that a link in between the presets does not flip-flop */
+	t->switch_intvl_usec *= 2;
+	if (t->switch_intvl_usec > TUNE_MAX_INTVL_USEC) {
+		t->switch_intvl_usec = TUNE_MAX_INTVL_USEC;
+	}
+	return SetFormatAndEncodings(conn);
+}
@@ -0,0 +1,55 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdbool.h>
+#include <rfb/rfbclient.h>
+
+/* Messages measured before automatic tuning considers switching presets. */
+#define TUNE_MIN_SAMPLES 16
+/* Automatic tuning waits at least this long between switches, the wait doubles after every switch. */
+#define TUNE_MIN_INTVL_USEC 3000000
+#define TUNE_MAX_INTVL_USEC 60000000
+/* A link is considered slow if an update spends more time than this waiting for network. */
+#define TUNE_SLOW_WAIT_USEC 20000
+
+/* How encodings, compression, and JPEG quality are chosen. */
+enum tune_mode {
+	TUNE_OFF,		/* Leave them to LibVNCClient and its command line options */
+	TUNE_LAN,		/* Encodings that are cheap to decode */
+	TUNE_WAN,		/* Encodings that are small on the wire, with aggressive JPEG quality */
+	TUNE_AUTO		/* Switch between LAN and WAN according to network wait and decoding time */
+};
+
+/* Settings of encodings, compression, and JPEG quality, see AppData of LibVNCClient. */
+struct tune_preset {
+	const char *name, *encodings;
+	int compress, quality;
+	bool jpeg;
+};
+
+/*
+ * Measure how long server messages take to handle, split into decoding (CPU time of IO thread)
+ * and waiting for network (the rest). In automatic mode, switch to WAN preset when network is the
+ * bottleneck, and to LAN preset when decoding is.
+ */
+struct tune {
+	enum tune_mode mode;
+	const struct tune_preset *preset;
+	/* Moving average of CPU time and network wait per message, in microseconds */
+	float avg_cpu_usec, avg_wait_usec;
+	int samples;
+	long long last_switch_usec, switch_intvl_usec;
+	unsigned long switches;
+};
+
+/* Initialise tuning, and apply its initial preset to the RFB client (before connecting). */
+void tune_init(struct tune *t, enum tune_mode mode, struct _rfbClient *conn);
+/*
+ * Count a server message that took the CPU time to decode and the time waiting for network. If automatic
+ * tuning decides to switch presets, apply the new preset to the RFB client and send it to server.
+ * Return false only on IO failure.
+ */
+bool tune_measure(struct tune *t, struct _rfbClient *conn, long long cpu_usec,
+		  long long wait_usec);
+
+#endif
@@ -2,19 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <rfb/keysym.h>
 #include <rfb/rfbclient.h>
 #include "viewer.h"
 
-/* Return current wall clock time in microseconds. */
-static suseconds_t get_time_usec()
-{
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec * 1000000 + now.tv_usec;
-}
-
 /* Messages to display in a static help menu. */
 static char const *viewer_help[] = {
 	"============ LEFT HAND ============",
@@ -23,6 +16,7 @@ static char const *viewer_help[] = {
 	"wasd  Pan viewer                   ",
 	"q/e   Zoom out/in                  ",
 	"Space Toggle display mouse pointer ",
+	"Tab   Focus next tile of wall      ",
 	"============ RIGHT HAND ===========",
 	"F10  Quit                          ",
 	"ijkl Move mouse cursor             ",
@@ -30,6 +24,7 @@ static char const *viewer_help[] = {
 	"789  Toggle hold L/M/R mouse button",
 	"0    Click middle mouse button     ",
 	"p    Find mouse pointer            ",
+	"f    Toggle performance counters   ",
 	"=========== TOGGLE KEYS ===========",
 	"z/m    Toggle hold L/R Control     ",
 	"x/n    Toggle hold L/R Shift       ",
@@ -44,40 +39,156 @@ static struct _rfbClient *rfb(struct viewer *v)
 	return v->vnc->conn;
 }
 
-bool viewer_init(struct viewer * v, struct vnc * vnc)
+/* Initialise everything but display and terminal output. Return false only on failure. */
+static bool viewer_init_common(struct viewer *v, struct vnc *vnc,
+			       struct opt *opt, struct pool *pool,
+			       const char *perf_csv)
 {
 	/* All bool switches are off by default */
 	memset(v, 0, sizeof(struct viewer));
+	v->vnc = vnc;
+	v->frame_intvl = 1000000 / opt->max_fps;
+	/* Tiles and headless viewers keep the frame rate cap and the finest dither */
+	gov_init(&v->gov, false, opt->max_fps, opt->latency_msec);
+	if (!perf_init(&v->perf, perf_csv)) {
+		return false;
+	}
 	/* Initialise visuals */
 	v->view = caca_create_canvas(0, 0);
-	if (!v->view) {
+	v->frame = caca_create_canvas(0, 0);
+	v->ready = caca_create_canvas(0, 0);
+	if (!v->view || !v->frame || !v->ready) {
 		fprintf(stderr, "Failed to create caca canvas\n");
 		return false;
 	}
-	v->disp = caca_create_display_with_driver(v->view, "ncurses");
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&v->render_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&v->render_lock, NULL);
+	if (pipe(v->frame_pipe) != 0) {
+		fprintf(stderr, "Failed to create frame pipe\n");
+		return false;
+	}
+	fcntl(v->frame_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(v->frame_pipe[1], F_SETFL, O_NONBLOCK);
+	if (!render_init(&v->render, pool)) {
+		return false;
+	}
+	render_set_mode(&v->render, opt->render_mode);
+	return true;
+}
+
+/* Initialise geometry and mouse pointer, once the size of canvas is known. */
+static void viewer_init_geo(struct viewer *v)
+{
+	/* Initialise parameters for geometry calculation */
+	v->last_facts = viewer_geo(v);
+	geo_init(&v->geo, v->last_facts);
+
+	/* Tell VNC to place mouse pointer to default position, unless only watching without a display */
+	if (v->disp != NULL) {
+		viewer_vnc_send_pointer(v);
+		vnc_flush_input(v->vnc);
+	}
+}
+
+bool viewer_init(struct viewer * v, struct vnc * vnc, struct opt * opt,
+		 struct pool * pool)
+{
+	if (!viewer_init_common(v, vnc, opt, pool, opt->perf_csv)) {
+		return false;
+	}
+	v->disp = caca_create_display_with_driver(v->view,
+						  opt->display_driver);
 	if (!v->disp) {
 		fprintf(stderr, "Failed to create caca display\n");
 		return false;
 	}
-	v->vnc = vnc;
+	if (opt->output == TERM_OUTPUT_NATIVE) {
+		/*
+		 * The ncurses driver remains in charge of keyboard input. Let it paint its first (blank)
+		 * screen now, otherwise its implicit refresh would wipe the first native frame.
+		 */
+		caca_refresh_display(v->disp);
+		if (!term_init(&v->term, STDOUT_FILENO, opt->colours)) {
+			return false;
+		}
+		v->native_output = true;
+	}
+	if (opt->cast_path != NULL) {
+		if (!cast_start(&v->cast, opt->cast_path)) {
+			return false;
+		}
+		v->casting = true;
+	}
+	gov_init(&v->gov, opt->governor, opt->max_fps, opt->latency_msec);
 	caca_set_display_title(v->disp, rfb(v)->desktopName);
+	viewer_init_geo(v);
+	return true;
+}
 
-	/* Initialise parameters for geometry calculation */
-	geo_init(&v->geo, viewer_geo(v));
+bool viewer_init_tile(struct viewer *v, struct vnc *vnc, struct opt *opt,
+		      struct pool *pool, caca_display_t * disp,
+		      int ch_width, int ch_height, int px_width,
+		      int px_height)
+{
+	if (!viewer_init_common(v, vnc, opt, pool, NULL)) {
+		return false;
+	}
+	v->disp = disp;
+	v->tile = true;
+	viewer_set_tile_size(v, ch_width, ch_height, px_width, px_height);
+	viewer_init_geo(v);
+	return true;
+}
 
-	/* Tell VNC to place mouse pointer to default position */
-	viewer_vnc_send_pointer(v);
+bool viewer_init_headless(struct viewer *v, struct vnc *vnc, struct opt *opt,
+			  struct pool *pool, int ch_width, int ch_height,
+			  int px_width, int px_height)
+{
+	if (!viewer_init_common(v, vnc, opt, pool, opt->perf_csv)) {
+		return false;
+	}
+	v->tile = true;
+	viewer_set_tile_size(v, ch_width, ch_height, px_width, px_height);
+	viewer_init_geo(v);
 	return true;
 }
 
+void viewer_set_tile_size(struct viewer *v, int ch_width, int ch_height,
+			  int px_width, int px_height)
+{
+	caca_set_canvas_size(v->view, ch_width, ch_height);
+	v->tile_px_width = px_width;
+	v->tile_px_height = px_height;
+	/* Aspect ratio of the tile may have changed */
+	if (v->last_facts.vnc_width > 0) {
+		geo_zoom(&v->geo, viewer_geo(v), 0);
+	}
+	v->redraw_full = true;
+}
+
 struct geo_facts viewer_geo(struct viewer *v)
 {
+	/* A tile covers only part of the terminal, if there is a terminal at all */
+	if (v->tile) {
+		struct geo_facts facts;
+		facts.px_width = v->tile_px_width;
+		facts.px_height = v->tile_px_height;
+		facts.ch_width = caca_get_canvas_width(v->view);
+		facts.ch_height = caca_get_canvas_height(v->view);
+		vnc_get_size(v->vnc, &facts.vnc_width, &facts.vnc_height,
+			     &facts.vnc_scale);
+		return facts;
+	}
 	return geo_facts_of(v->vnc, v->disp, v->view);
 }
 
-void viewer_disp_status(struct viewer *v)
+/* Format the status row message into the buffer. */
+static void viewer_status_msg(struct viewer *v, char *buf, size_t len)
 {
-	caca_set_color_ansi(v->view, CACA_WHITE, CACA_BLUE);
 	char *conn_remark = "";
 	if (!v->vnc->connected) {
 		conn_remark = "(Disconnected)";
@@ -133,123 +244,532 @@ void viewer_disp_status(struct viewer *v)
 		strcat(held_controls_msg, "| Holding down:");
 		strcat(held_controls_msg, held_controls);
 	}
-	caca_printf(v->view, 0, 0, "h:Help | %s:%d%s | %s %s",
-		    rfb(v)->serverHost, rfb(v)->serverPort, conn_remark,
-		    who_has_input, held_controls_msg);
+	char gov_msg[40] = { 0 };
+	if (v->gov.enabled) {
+		snprintf(gov_msg, sizeof(gov_msg), "| %dfps %s ",
+			 gov_fps(&v->gov), v->gov.algorithm);
+	}
+	snprintf(buf, len, "h:Help | %s:%d%s | %s %s%s", rfb(v)->serverHost,
+		 rfb(v)->serverPort, conn_remark, who_has_input, gov_msg,
+		 held_controls_msg);
+}
+
+void viewer_scene_of(struct viewer *v, struct viewer_scene *scene)
+{
+	memset(scene, 0, sizeof(struct viewer_scene));
+	struct geo_facts facts = viewer_geo(v);
+	/* Frame-buffer has been resized, perhaps scaled by server */
+	if (facts.vnc_width != v->last_facts.vnc_width
+	    || facts.vnc_height != v->last_facts.vnc_height) {
+		geo_resize(&v->geo, v->last_facts, facts);
+	}
+	v->last_facts = facts;
+	scene->geo = v->geo;
+	scene->facts = facts;
+	viewer_status_msg(v, scene->status, sizeof(scene->status));
+	strncpy(scene->algorithm, v->gov.algorithm,
+		sizeof(scene->algorithm) - 1);
+	scene->disp_help = v->disp_help;
+	scene->disp_perf = v->disp_perf;
+	scene->draw_mouse_pointer = v->draw_mouse_pointer;
+	scene->bare = v->disp == NULL;
+	if (v->disp_perf) {
+		memcpy(scene->hud, v->perf.hud, sizeof(scene->hud));
+	}
 }
 
-void viewer_disp_help(struct viewer *v)
+void viewer_disp_status(caca_canvas_t * canvas, struct viewer_scene *scene)
 {
-	caca_set_color_ansi(v->view, CACA_WHITE, CACA_BLUE);
+	caca_set_color_ansi(canvas, CACA_WHITE, CACA_BLUE);
+	caca_put_str(canvas, 0, 0, scene->status);
+}
+
+void viewer_disp_help(caca_canvas_t * canvas)
+{
+	caca_set_color_ansi(canvas, CACA_WHITE, CACA_BLUE);
 	int i;
 	for (i = 0; viewer_help[i] != NULL; i++) {
-		caca_put_str(v->view, 0, 1 + i, viewer_help[i]);
+		caca_put_str(canvas, 0, 1 + i, viewer_help[i]);
 	}
 }
 
-void viewer_redraw(struct viewer *v)
+void viewer_disp_perf(caca_canvas_t * canvas, struct viewer_scene *scene)
+{
+	int x = caca_get_canvas_width(canvas) - PERF_HUD_WIDTH;
+	caca_set_color_ansi(canvas, CACA_WHITE, CACA_BLUE);
+	int i;
+	for (i = 0; i < PERF_HUD_LINES; i++) {
+		/* Pad lines to the same width, so that a shorter line covers the longer one before it */
+		caca_printf(canvas, x, 1 + i, "%-*s", PERF_HUD_WIDTH,
+			    scene->hud[i]);
+	}
+}
+
+bool viewer_render(struct viewer *v, struct viewer_scene *scene, bool full,
+		   caca_canvas_t * canvas, struct perf_frame *frame)
 {
-	caca_clear_canvas(v->view);
 	/*
 	 * Run the latest frame-buffer content through Floyd–Steinberg algorithm -
 	 * it seems to offer higher quality over other algorithm choices.
-	 * The dither parameters are tailored for a connection on 32-bit RGB colours.
+	 * The pipeline is rebuilt only if frame-buffer size or format has changed,
+	 * and it uses native renderer whenever the pixel format allows.
+	 * When zoomed out, it samples a reduced level of frame-buffer pyramid.
+	 * The snapshot of frame-buffer stays unchanged until rendering is done.
 	 */
-	if (v->fb_dither != NULL) {
-		caca_free_dither(v->fb_dither);
+	long long begin = perf_now_usec();
+	struct vnc_damage damage;
+	vnc_lock_frame(v->vnc, &damage);
+	vnc_take_stats(v->vnc, frame);
+	/* Geometry of the scene follows frame-buffer resize soon, until then render what is there (snapshot is locked) */
+	struct geo_facts facts = scene->facts;
+	facts.vnc_width = v->vnc->width;
+	facts.vnc_height = v->vnc->height;
+	facts.vnc_scale = v->vnc->scale;
+	if (caca_get_canvas_width(canvas) != facts.ch_width
+	    || caca_get_canvas_height(canvas) != facts.ch_height) {
+		caca_set_canvas_size(canvas, facts.ch_width, facts.ch_height);
+	}
+	/* A tile whose server could not be reached has no frame-buffer, only its status row */
+	if (facts.vnc_width == 0 || facts.vnc_height == 0) {
+		vnc_unlock_frame(v->vnc);
+		caca_set_color_ansi(canvas, CACA_DEFAULT, CACA_DEFAULT);
+		caca_clear_canvas(canvas);
+		frame->render_usec = perf_now_usec() - begin;
+		v->marker_drawn = false;
+		v->cursor_rect.width = 0;
+		strcpy(v->last_status, scene->status);
+		if (!scene->bare) {
+			viewer_disp_status(canvas, scene);
+		}
+		return true;
 	}
-	struct geo_facts facts = viewer_geo(v);
-	v->fb_dither =
-	    caca_create_dither(32, facts.vnc_width, facts.vnc_height,
-			       facts.vnc_width * 4, 0x000000ff, 0x0000ff00,
-			       0x00ff0000, 0);
-	caca_set_dither_algorithm(v->fb_dither, "fstein");
-	caca_set_dither_gamma(v->fb_dither, 1.0);
 	struct geo_dither_params params =
-	    geo_get_dither_params(&v->geo, viewer_geo(v));
-	caca_dither_bitmap(v->view, params.x, params.y, params.width,
-			   params.height, v->fb_dither, rfb(v)->frameBuffer);
+	    geo_get_dither_params(&scene->geo, facts);
+	/* A different algorithm applies to the entire canvas at once */
+	if (strcmp(scene->algorithm, v->render.algorithm) != 0) {
+		render_set_algorithm(&v->render, scene->algorithm,
+				     v->render.gamma);
+		full = true;
+	}
+	if (!render_prepare(&v->render, render_fb_of(v->vnc), &damage,
+			    &params)) {
+		vnc_unlock_frame(v->vnc);
+		rfbClientErr("Failed to prepare render pipeline\n");
+		return false;
+	}
+	/*
+	 * Server only has to send pixels visible in the zoomed in view, zooming out lifts the restriction.
+	 * When zoomed out, server may as well scale frame-buffer down to roughly the size of canvas.
+	 */
+	if (facts.vnc_width > 0 && facts.vnc_height > 0) {
+		vnc_set_viewport(v->vnc, geo_visible_px_rect(&params));
+		vnc_set_scale(v->vnc, geo_scale_of(&params));
+	}
 	/*
 	 * Mouse cursors are usually wider than 14 pixels. If it will not take
 	 * more than 5 characters to draw the cusor, then consider it very
 	 * difficult to spot on the VNC canvas, and draw a red block right there.
 	 */
-	int mouse_ch_x = geo_dither_ch_px_x(&params, v->geo.mouse_x);
-	int mouse_ch_y = geo_dither_ch_px_y(&params, v->geo.mouse_y);
-	if (geo_dither_numch_x(&params, 12) < 5) {
-		caca_set_color_ansi(v->view, CACA_WHITE, CACA_RED);
-		caca_fill_box(v->view, mouse_ch_x - 1, mouse_ch_y - 1, 3, 3,
-			      '*');
+	int mouse_ch_x = geo_dither_ch_px_x(&params, scene->geo.mouse_x);
+	int mouse_ch_y = geo_dither_ch_px_y(&params, scene->geo.mouse_y);
+	bool draw_marker_block = !scene->bare
+	    && geo_dither_numch_x(&params, 12) < 5;
+	bool draw_marker = draw_marker_block || scene->draw_mouse_pointer;
+	/*
+	 * The entire canvas is dithered only if the geometry has changed. Otherwise
+	 * only the characters covering frame-buffer updates are dithered again, and
+	 * an idle remote desktop costs next to nothing to render.
+	 */
+	if (damage.full || full
+	    || memcmp(&params, &v->last_params, sizeof(params)) != 0) {
+		render_full(&v->render, canvas, &params);
+		v->last_params = params;
+	} else {
+		int i;
+		for (i = 0; i < damage.num_rects; i++) {
+			struct vnc_rect *r = &damage.rects[i];
+			render_rect(&v->render, canvas, &params,
+				    geo_dither_ch_rect(&params, r->x, r->y,
+						       r->w, r->h));
+		}
+		/*
+		 * Restore the characters underneath mouse marker if it has moved away,
+		 * and the status row if its message has changed.
+		 */
+		if (v->marker_drawn && (!draw_marker
+					|| mouse_ch_x != v->marker_ch_x
+					|| mouse_ch_y != v->marker_ch_y)) {
+			struct geo_rect marker =
+			    { v->marker_ch_x - 1, v->marker_ch_y - 1, 3, 3 };
+			render_rect(&v->render, canvas, &params, marker);
+		}
+		/* Likewise the characters underneath cursor shape, if it has moved or changed */
+		if (v->cursor_rect.width > 0
+		    && (scene->geo.mouse_x != v->cursor_px_x
+			|| scene->geo.mouse_y != v->cursor_px_y
+			|| v->vnc->cursor.seq != v->cursor_seq)) {
+			render_rect(&v->render, canvas, &params, v->cursor_rect);
+		}
+		if (!scene->bare && strcmp(scene->status, v->last_status) != 0) {
+			struct geo_rect status = { 0, 0, facts.ch_width, 1 };
+			render_rect(&v->render, canvas, &params, status);
+		}
+	}
+	/*
+	 * Server that sends cursor shape leaves cursor out of frame-buffer, it is painted over the
+	 * characters here instead. Moving it repaints only the characters under old and new location.
+	 */
+	v->cursor_rect.width = 0;
+	if (!scene->bare) {
+		v->cursor_rect = render_cursor(&v->render, canvas, &params,
+					       &v->vnc->cursor,
+					       scene->geo.mouse_x,
+					       scene->geo.mouse_y);
+	}
+	v->cursor_px_x = scene->geo.mouse_x;
+	v->cursor_px_y = scene->geo.mouse_y;
+	v->cursor_seq = v->vnc->cursor.seq;
+	vnc_unlock_frame(v->vnc);
+	frame->render_usec = perf_now_usec() - begin;
+	if (draw_marker_block) {
+		caca_set_color_ansi(canvas, CACA_WHITE, CACA_RED);
+		caca_fill_box(canvas, mouse_ch_x - 1, mouse_ch_y - 1, 3, 3, '*');
 	}
 	/* Draw local mouse pointer */
-	if (v->draw_mouse_pointer) {
-		caca_set_color_ansi(v->view, CACA_WHITE, CACA_RED);
-		caca_put_char(v->view, mouse_ch_x, mouse_ch_y, '*');
+	if (scene->draw_mouse_pointer) {
+		caca_set_color_ansi(canvas, CACA_WHITE, CACA_RED);
+		caca_put_char(canvas, mouse_ch_x, mouse_ch_y, '*');
 	}
-	viewer_disp_status(v);
-	if (v->disp_help) {
-		viewer_disp_help(v);
+	v->marker_drawn = draw_marker;
+	v->marker_ch_x = mouse_ch_x;
+	v->marker_ch_y = mouse_ch_y;
+	strcpy(v->last_status, scene->status);
+	if (scene->bare) {
+		return true;
 	}
-	caca_refresh_display(v->disp);
+	viewer_disp_status(canvas, scene);
+	if (scene->disp_help) {
+		viewer_disp_help(canvas);
+	}
+	if (scene->disp_perf) {
+		viewer_disp_perf(canvas, scene);
+	}
+	return true;
 }
 
-void viewer_ev_loop(struct viewer *v)
+void viewer_count_inputs(struct viewer *v)
+{
+	unsigned long inputs;
+	long long latency;
+	vnc_take_inputs(v->vnc, &inputs, &latency);
+	perf_input_sent(&v->perf, inputs, latency);
+}
+
+/* Write the display canvas to terminal, and count the frame. */
+static void viewer_output(struct viewer *v, struct perf_frame *frame)
+{
+	long long begin = perf_now_usec();
+	if (v->native_output) {
+		term_refresh(&v->term, v->view);
+	} else {
+		caca_refresh_display(v->disp);
+	}
+	/* The cast stores what has changed since its latest frame, much like native output */
+	if (v->casting && !cast_frame(&v->cast, v->view, perf_now_usec())) {
+		rfbClientErr
+		    ("Failed to write cast, the rest of session is not recorded\n");
+		cast_stop(&v->cast);
+		v->casting = false;
+	}
+	frame->output_usec = perf_now_usec() - begin;
+	viewer_count_inputs(v);
+	perf_frame_done(&v->perf, frame);
+	/* Render thread follows the frame interval of governor, the algorithm goes along with scene */
+	if (gov_frame(&v->gov, frame,
+		      v->native_output ? v->term.frame_bytes : 0)) {
+		pthread_mutex_lock(&v->render_lock);
+		v->frame_intvl = v->gov.frame_intvl;
+		pthread_mutex_unlock(&v->render_lock);
+	}
+}
+
+void viewer_redraw(struct viewer *v)
+{
+	struct viewer_scene scene;
+	struct perf_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	viewer_scene_of(v, &scene);
+	bool full = v->redraw_full;
+	v->redraw_full = false;
+	if (!viewer_render(v, &scene, full, v->frame, &frame)) {
+		v->redraw_full = true;
+		return;
+	}
+	caca_blit(v->view, 0, 0, v->frame, NULL);
+	viewer_output(v, &frame);
+}
+
+/* Add the work done for a frame into the destination. */
+static void viewer_add_stats(struct perf_frame *dest, struct perf_frame *src)
+{
+	dest->updates += src->updates;
+	dest->rects += src->rects;
+	dest->bytes += src->bytes;
+	dest->skipped += src->skipped;
+	dest->decode_usec += src->decode_usec;
+	dest->render_usec += src->render_usec;
+}
+
+/* Wait until the time on monotonic clock, or until woken up earlier. Caller must hold render lock. */
+static void viewer_render_wait(struct viewer *v, long long until_usec)
+{
+	struct timespec ts;
+	ts.tv_sec = until_usec / 1000000;
+	ts.tv_nsec = (until_usec % 1000000) * 1000;
+	pthread_cond_timedwait(&v->render_cond, &v->render_lock, &ts);
+}
+
+/*
+ * Render the latest scene whenever input thread asks for it, but not faster than the frame rate
+ * cap unless geometry has changed. Hand the frame over to input thread for terminal output.
+ * Return NULL.
+ */
+static void *viewer_render_fun(void *struct_viewer)
+{
+	struct viewer *v = (struct viewer *)struct_viewer;
+	struct viewer_scene scene;
+	unsigned long rendered_seq = 0;
+	pthread_mutex_lock(&v->render_lock);
+	while (v->cont_render) {
+		if (!v->scene_dirty) {
+			pthread_cond_wait(&v->render_cond, &v->render_lock);
+			continue;
+		}
+		long long now = perf_now_usec();
+		if (v->scene_seq == rendered_seq
+		    && now - v->last_frame < v->frame_intvl) {
+			viewer_render_wait(v, v->last_frame + v->frame_intvl);
+			continue;
+		}
+		scene = v->scene;
+		rendered_seq = v->scene_seq;
+		bool full = v->redraw_full;
+		v->scene_dirty = false;
+		v->redraw_full = false;
+		pthread_mutex_unlock(&v->render_lock);
+
+		struct perf_frame frame;
+		memset(&frame, 0, sizeof(frame));
+		v->last_frame = now;
+		bool rendered = viewer_render(v, &scene, full, v->frame, &frame);
+
+		pthread_mutex_lock(&v->render_lock);
+		if (!rendered) {
+			v->redraw_full = true;
+			continue;
+		}
+		/*
+		 * Newer geometry has arrived while rendering, and the frame is already outdated.
+		 * Drop it, unless the screen would freeze while geometry keeps changing.
+		 */
+		if (v->scene_seq != rendered_seq
+		    && perf_now_usec() - v->last_shown < VIEWER_MAX_STALE_USEC) {
+			v->frames_dropped++;
+			viewer_add_stats(&v->ready_stats, &frame);
+			continue;
+		}
+		caca_set_canvas_size(v->ready, caca_get_canvas_width(v->frame),
+				     caca_get_canvas_height(v->frame));
+		caca_blit(v->ready, 0, 0, v->frame, NULL);
+		viewer_add_stats(&v->ready_stats, &frame);
+		v->frame_ready = true;
+		v->last_shown = perf_now_usec();
+		char ch = 0;
+		if (write(v->frame_pipe[1], &ch, 1) == -1) {
+			/* The pipe is full, input thread is already due to wake up */
+		}
+	}
+	pthread_mutex_unlock(&v->render_lock);
+	return NULL;
+}
+
+/* Hand the latest state of viewer over to render thread. Ask for a new frame if anything has changed, or if redraw is set. */
+static void viewer_post_scene(struct viewer *v, bool redraw)
+{
+	struct viewer_scene scene;
+	viewer_scene_of(v, &scene);
+	pthread_mutex_lock(&v->render_lock);
+	if (memcmp(&scene.geo, &v->scene.geo, sizeof(scene.geo)) != 0
+	    || memcmp(&scene.facts, &v->scene.facts, sizeof(scene.facts)) != 0) {
+		v->scene_seq++;
+		redraw = true;
+	} else if (memcmp(&scene, &v->scene, sizeof(scene)) != 0) {
+		redraw = true;
+	}
+	if (redraw) {
+		v->scene = scene;
+		v->scene_dirty = true;
+		pthread_cond_signal(&v->render_cond);
+	}
+	pthread_mutex_unlock(&v->render_lock);
+}
+
+/* Write the frame handed over by render thread to terminal, if there is one. */
+static void viewer_show_frame(struct viewer *v)
+{
+	char buf[64];
+	while (read(v->frame_pipe[0], buf, sizeof(buf)) > 0) {
+		/* Consume the notifications */
+	}
+	struct perf_frame frame;
+	pthread_mutex_lock(&v->render_lock);
+	bool ready = v->frame_ready;
+	if (ready) {
+		caca_blit(v->view, 0, 0, v->ready, NULL);
+		frame = v->ready_stats;
+		memset(&v->ready_stats, 0, sizeof(v->ready_stats));
+		v->frame_ready = false;
+	}
+	pthread_mutex_unlock(&v->render_lock);
+	if (ready) {
+		viewer_output(v, &frame);
+	}
+}
+
+/* Handle keyboard input and canvas events, and write frames to terminal. Block caller until quit key is pressed and handled. */
+static void viewer_input_loop(struct viewer *v)
 {
 	int ev_accept =
 	    CACA_EVENT_KEY_PRESS | CACA_EVENT_RESIZE | CACA_EVENT_QUIT;
+	struct pollfd fds[3];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = vnc_notify_fd(v->vnc);
+	fds[1].events = POLLIN;
+	fds[2].fd = v->frame_pipe[0];
+	fds[2].events = POLLIN;
+	v->need_redraw = true;
 	while (true) {
-		/* Listen to the latest event */
+		/* Handle all of the events that have arrived so far */
+		v->input_arrival = perf_now_usec();
 		caca_event_t ev;
-		caca_get_event(v->disp, ev_accept, &ev,
-			       VIEWER_FRAME_INTVL_USEC);
-		/* Certain types of events are caca calling quit */
-		enum caca_event_type ev_type = caca_get_event_type(&ev);
-		if (ev_type & CACA_EVENT_QUIT || ev_type & CACA_EVENT_NONE) {
-			return;
-		}
-		/* Handle previously banked escape key (VNC input), send it to VNC. */
-		if (v->last_vnc_esc != 0
-		    && get_time_usec() - v->last_vnc_esc >=
-		    VIEWER_FRAME_INTVL_USEC) {
-			v->last_vnc_esc = 0;
-			viewer_vnc_click_key(v, cacakey2vnc(CACA_KEY_ESCAPE));
-		}
-		/* Redraw at a constant frame rate when there is no key input */
-		if (!(ev_type & CACA_EVENT_KEY_PRESS)) {
-			viewer_redraw(v);
-			continue;
+		while (caca_get_event(v->disp, ev_accept, &ev, 0)) {
+			/* Certain types of events are caca calling quit */
+			enum caca_event_type ev_type =
+			    caca_get_event_type(&ev);
+			if (ev_type & CACA_EVENT_QUIT) {
+				return;
+			}
+			v->need_redraw = true;
+			if ((ev_type & CACA_EVENT_RESIZE) && v->native_output) {
+				/* Let ncurses settle its own repaint, then repaint every character natively */
+				caca_refresh_display(v->disp);
+				term_invalidate(&v->term);
+			}
+			if (!(ev_type & CACA_EVENT_KEY_PRESS)) {
+				continue;
+			}
+			if (!viewer_handle_key(v, caca_get_event_key_ch(&ev))) {
+				return;
+			}
 		}
-		int ev_char = caca_get_event_key_ch(&ev);
-		/* Input never gets directed at VNC if it is disconnected */
-		if (!v->vnc->connected) {
-			v->input2vnc = false;
+		int timeout_ms = viewer_flush_input(v);
+		/* Content that has settled gets the finer dither, the next scene carries it to render thread */
+		gov_tick(&v->gov);
+		int gov_due_ms = gov_due_msec(&v->gov);
+		if (gov_due_ms >= 0
+		    && (timeout_ms < 0 || gov_due_ms < timeout_ms)) {
+			timeout_ms = gov_due_ms;
 		}
-		/* A key input is directed at either VNC or viewer controls */
-		if (v->input2vnc && ev_char != '`') {
-			viewer_input_to_vnc(v, ev_char);
-		} else if (!viewer_handle_control(v, ev_char)) {
-			return;
+		/* Frame-buffer has new content or connection has been lost */
+		if (vnc_take_notification(v->vnc)) {
+			v->need_redraw = true;
 		}
+		/* Render thread redraws whenever anything has changed, immediately if geometry has */
+		viewer_post_scene(v, v->need_redraw);
+		v->need_redraw = false;
+		viewer_show_frame(v);
+		/* Sleep until the next input, update, frame, due escape key, or decision of governor. */
+		poll(fds, 3, timeout_ms);
+	}
+}
+
+bool viewer_handle_key(struct viewer *v, int caca_key)
+{
+	/* Input never gets directed at VNC if it is disconnected */
+	if (!v->vnc->connected) {
+		v->input2vnc = false;
+	}
+	/* A key input is directed at either VNC or viewer controls */
+	if (v->input2vnc && caca_key != '`') {
+		viewer_input_to_vnc(v, caca_key);
+		return true;
+	}
+	return viewer_handle_control(v, caca_key);
+}
+
+int viewer_flush_input(struct viewer *v)
+{
+	/* Apply the pan, zoom, and mouse movement queued so far as one change */
+	viewer_apply_input(v);
+	/* Handle previously banked escape key (VNC input), send it to VNC. */
+	long long now = perf_now_usec();
+	if (v->last_vnc_esc != 0
+	    && now - v->last_vnc_esc >= VIEWER_ESC_COMBO_USEC) {
+		v->last_vnc_esc = 0;
+		viewer_vnc_click_key(v, cacakey2vnc(CACA_KEY_ESCAPE));
+	}
+	/* Everything sent to VNC in this iteration goes out in one write */
+	vnc_flush_input(v->vnc);
+	if (v->last_vnc_esc == 0) {
+		return -1;
+	}
+	return (v->last_vnc_esc + VIEWER_ESC_COMBO_USEC - now + 999) / 1000;
+}
+
+void viewer_ev_loop(struct viewer *v)
+{
+	v->cont_render = true;
+	if (pthread_create(&v->render_thread, NULL, viewer_render_fun,
+			   (void *)v) != 0) {
+		fprintf(stderr, "Failed to create render thread\n");
+		return;
+	}
+	viewer_input_loop(v);
+	pthread_mutex_lock(&v->render_lock);
+	v->cont_render = false;
+	pthread_cond_signal(&v->render_cond);
+	pthread_mutex_unlock(&v->render_lock);
+	if (pthread_join(v->render_thread, NULL) != 0) {
+		fprintf(stderr, "Failed to join render thread\n");
+	}
+	if (v->frames_dropped > 0) {
+		rfbClientLog
+		    ("Frames: %lu rendered for outdated geometry and dropped\n",
+		     v->frames_dropped);
 	}
 }
 
 void viewer_vnc_click_key(struct viewer *v, int vnc_key)
 {
-	SendKeyEvent(rfb(v), vnc_key, TRUE);
-	SendKeyEvent(rfb(v), vnc_key, FALSE);
+	vnc_queue_key(v->vnc, vnc_key, true);
+	vnc_queue_key(v->vnc, vnc_key, false);
+	vnc_mark_input(v->vnc, v->input_arrival);
 }
 
 void viewer_vnc_click_ctrl_key_combo(struct viewer *v, int vnc_key)
 {
-	SendKeyEvent(rfb(v), XK_Control_L, TRUE);
-	SendKeyEvent(rfb(v), vnc_key, TRUE);
-	SendKeyEvent(rfb(v), vnc_key, FALSE);
-	SendKeyEvent(rfb(v), XK_Control_L, FALSE);
+	vnc_queue_key(v->vnc, XK_Control_L, true);
+	vnc_queue_key(v->vnc, vnc_key, true);
+	vnc_queue_key(v->vnc, vnc_key, false);
+	vnc_queue_key(v->vnc, XK_Control_L, false);
+	vnc_mark_input(v->vnc, v->input_arrival);
 }
 
 void viewer_vnc_toggle_key(struct viewer *v, int vnc_key, bool key_down)
 {
-	SendKeyEvent(rfb(v), vnc_key, key_down ? TRUE : FALSE);
+	vnc_queue_key(v->vnc, vnc_key, key_down);
+	vnc_mark_input(v->vnc, v->input_arrival);
 }
 
 void viewer_vnc_send_pointer(struct viewer *v)
@@ -264,7 +784,10 @@ void viewer_vnc_send_pointer(struct viewer *v)
 	if (v->mouse_right) {
 		mask |= rfbButton3Mask;
 	}
-	SendPointerEvent(rfb(v), v->geo.mouse_x, v->geo.mouse_y, mask);
+	vnc_queue_pointer(v->vnc, v->geo.mouse_x, v->geo.mouse_y, mask);
+	if (v->input_arrival != 0) {
+		vnc_mark_input(v->vnc, v->input_arrival);
+	}
 }
 
 void viewer_input_to_vnc(struct viewer *v, int caca_key)
@@ -277,7 +800,7 @@ void viewer_input_to_vnc(struct viewer *v, int caca_key)
 	 * dealt with later.
 	 */
 	if (caca_key == CACA_KEY_ESCAPE) {
-		v->last_vnc_esc = get_time_usec();
+		v->last_vnc_esc = perf_now_usec();
 		return;
 	}
 	/*
@@ -369,9 +892,8 @@ void viewer_input_to_vnc(struct viewer *v, int caca_key)
 	 * Occasionally it takes even longer to arrive but there is no way to
 	 * work around it.
 	 */
-	suseconds_t elapsed = get_time_usec() - v->last_vnc_esc;
-	if (elapsed < VIEWER_FRAME_INTVL_USEC
-	    && elapsed < VIEWER_MAX_INPUT_INTVL_USEC) {
+	long long elapsed = perf_now_usec() - v->last_vnc_esc;
+	if (elapsed < VIEWER_ESC_COMBO_USEC) {
 		viewer_vnc_toggle_key(v, XK_Alt_L, true);
 		viewer_vnc_click_key(v, translated_ch);
 		viewer_vnc_toggle_key(v, XK_Alt_L, false);
@@ -382,95 +904,127 @@ void viewer_input_to_vnc(struct viewer *v, int caca_key)
 	viewer_vnc_click_key(v, translated_ch);
 }
 
-bool viewer_handle_control(struct viewer * v, int caca_key)
+/* Make the next frame dither the entire canvas. */
+static void viewer_redraw_full(struct viewer *v)
 {
-	/*
-	 * When the canvas is too busy panning/zooming, causing very low FPS,
-	 * the terminal occasionally generates repeatitive key input seemingly
-	 * out of nowhere, in very short successions. To work around it, this
-	 * condition caps number of viewe controls to approximately 10 per second.
-	 */
-	suseconds_t elapsed = get_time_usec() - v->last_viewer_control;
-	if (v->last_viewer_control != 0
-	    && elapsed < VIEWER_MAX_INPUT_INTVL_USEC) {
-		return true;
-	}
-	/*
-	 * In order to avoid redrawing too rapidly, only viewer zoom/pan
-	 * actions redraw immediately.
-	 * VNC input has to wait for main loop to redraw at an interval.
-	 */
+	pthread_mutex_lock(&v->render_lock);
+	v->redraw_full = true;
+	pthread_mutex_unlock(&v->render_lock);
+}
+
+/* Queue a pan, zoom, or mouse movement key. Return false only if it is none of them. */
+static bool viewer_queue_input(struct viewer *v, int caca_key)
+{
+	struct viewer_input *in = &v->input;
 	switch (caca_key) {
-	case 'h':
-	case 'H':
-		v->disp_help = !v->disp_help;
-		break;
-	case CACA_KEY_F10:
-		return false;
 		/* Left hand */
 	case 'w':
 	case 'W':
-		geo_pan(&v->geo, 0, -1);
-		viewer_redraw(v);
+		in->pan_y--;
 		break;
 	case 'a':
 	case 'A':
-		geo_pan(&v->geo, -1, 0);
-		viewer_redraw(v);
+		in->pan_x--;
 		break;
 	case 's':
 	case 'S':
-		geo_pan(&v->geo, 0, 1);
-		viewer_redraw(v);
+		in->pan_y++;
 		break;
 	case 'd':
 	case 'D':
-		geo_pan(&v->geo, 1, 0);
-		viewer_redraw(v);
+		in->pan_x++;
 		break;
 	case 'q':
 	case 'Q':
-		geo_zoom(&v->geo, viewer_geo(v), -1);
-		viewer_redraw(v);
+		in->zoom--;
 		break;
 	case 'e':
 	case 'E':
-		geo_zoom(&v->geo, viewer_geo(v), 1);
-		viewer_redraw(v);
-		break;
-	case '`':
-		if (v->vnc->connected) {
-			v->input2vnc = !v->input2vnc;
-		}
-		break;
-	case '~':
-		/* Click back-tick (96 in ASCII) in VNC */
-		viewer_vnc_click_key(v, 96);
-		break;
-	case ' ':
-		v->draw_mouse_pointer = !v->draw_mouse_pointer;
+		in->zoom++;
 		break;
 		/* Right hand */
 	case 'i':
 	case 'I':
-		geo_move_mouse(&v->geo, viewer_geo(v), 0, -1);
-		viewer_vnc_send_pointer(v);
+		in->mouse_y--;
 		break;
 	case 'j':
 	case 'J':
-		geo_move_mouse(&v->geo, viewer_geo(v), -1, 0);
-		viewer_vnc_send_pointer(v);
+		in->mouse_x--;
 		break;
 	case 'k':
 	case 'K':
-		geo_move_mouse(&v->geo, viewer_geo(v), 0, 1);
-		viewer_vnc_send_pointer(v);
+		in->mouse_y++;
 		break;
 	case 'l':
 	case 'L':
-		geo_move_mouse(&v->geo, viewer_geo(v), 1, 0);
+		in->mouse_x++;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+bool viewer_apply_input(struct viewer *v)
+{
+	struct viewer_input *in = &v->input;
+	bool view_changed = in->zoom != 0 || in->pan_x != 0 || in->pan_y != 0;
+	/* Zoom comes first, the steps of panning and mouse movement depend on zoom level */
+	if (in->zoom != 0) {
+		geo_zoom(&v->geo, viewer_geo(v), in->zoom);
+	}
+	if (in->pan_x != 0 || in->pan_y != 0) {
+		geo_pan(&v->geo, in->pan_x, in->pan_y);
+	}
+	if (in->mouse_x != 0 || in->mouse_y != 0) {
+		geo_move_mouse(&v->geo, viewer_geo(v), in->mouse_x,
+			       in->mouse_y);
 		viewer_vnc_send_pointer(v);
+	}
+	memset(in, 0, sizeof(struct viewer_input));
+	return view_changed;
+}
+
+bool viewer_handle_control(struct viewer * v, int caca_key)
+{
+	/*
+	 * A burst of pan, zoom, and mouse movement keys (e.g. holding a key, or the terminal
+	 * catching up after a slow frame) adds up to a single change, which event loop applies
+	 * and redraws once after handling all of the input that has arrived.
+	 */
+	if (viewer_queue_input(v, caca_key)) {
+		return true;
+	}
+	/* Other controls see the effect of the keys that came before them */
+	viewer_apply_input(v);
+	switch (caca_key) {
+	case 'h':
+	case 'H':
+		v->disp_help = !v->disp_help;
+		/* The help menu covered part of the image */
+		viewer_redraw_full(v);
 		break;
+	case 'f':
+	case 'F':
+		v->disp_perf = !v->disp_perf;
+		/* The counters covered part of the image */
+		viewer_redraw_full(v);
+		break;
+	case CACA_KEY_F10:
+		return false;
+	case '`':
+		if (v->vnc->connected) {
+			v->input2vnc = !v->input2vnc;
+		}
+		break;
+	case '~':
+		/* Click back-tick (96 in ASCII) in VNC */
+		viewer_vnc_click_key(v, 96);
+		break;
+	case ' ':
+		v->draw_mouse_pointer = !v->draw_mouse_pointer;
+		break;
+		/* Right hand */
 	case 'u':
 	case 'U':
 		v->mouse_left = true;
@@ -544,19 +1098,54 @@ bool viewer_handle_control(struct viewer * v, int caca_key)
 		viewer_vnc_toggle_key(v, XK_Super_L, v->hold_lsuper);
 		break;
 	}
-	v->last_viewer_control = get_time_usec();
 	return true;
 }
 
 void viewer_terminate(struct viewer *v)
 {
-	if (v->fb_dither != NULL) {
-		caca_free_dither(v->fb_dither);
+	render_destroy(&v->render);
+	perf_destroy(&v->perf);
+	if (v->native_output) {
+		if (v->term.frames > 0) {
+			rfbClientLog
+			    ("Terminal output: %lu frames, %.0f bytes and %.2f writes per frame\n",
+			     v->term.frames,
+			     (double)v->term.total_bytes / v->term.frames,
+			     (double)v->term.total_writes / v->term.frames);
+		}
+		term_destroy(&v->term);
 	}
-	if (v->disp != NULL) {
+	if (v->gov.enabled) {
+		rfbClientLog
+		    ("Governor: %dfps and %s dither at last, switched %lu times, %.1fKB output per frame\n",
+		     gov_fps(&v->gov), v->gov.algorithm, v->gov.switches,
+		     v->gov.avg_output_bytes / 1024);
+	}
+	if (v->casting) {
+		if (v->cast.frames > 0) {
+			rfbClientLog
+			    ("Cast: %lu frames, %.0f bytes and %.3fms per frame\n",
+			     v->cast.frames,
+			     (double)v->cast.bytes / v->cast.frames,
+			     v->cast.usec / 1000.0 / v->cast.frames);
+		}
+		cast_stop(&v->cast);
+	}
+	/* Display of a tile belongs to the wall */
+	if (v->disp != NULL && !v->tile) {
 		caca_free_display(v->disp);
 	}
 	if (v->view != NULL) {
 		caca_free_canvas(v->view);
 	}
+	if (v->frame != NULL) {
+		caca_free_canvas(v->frame);
+	}
+	if (v->ready != NULL) {
+		caca_free_canvas(v->ready);
+	}
+	pthread_cond_destroy(&v->render_cond);
+	pthread_mutex_destroy(&v->render_lock);
+	close(v->frame_pipe[0]);
+	close(v->frame_pipe[1]);
 }
@@ -2,20 +2,50 @@
 #define VIEWER_H
 
 #include <caca.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include "cast.h"
 #include "geo.h"
+#include "gov.h"
+#include "opt.h"
+#include "perf.h"
+#include "render.h"
+#include "term.h"
 #include "vnc.h"
 
 /*
- * The viewer will render frame-buffer content at roughly this many frames per second.
- * It does not take rendering algorithm itself into account, hence the value is a rough estimate at best.
- * The perceived FPS decreases as terminal gets larger.
- * Do not raise the value too high or controls will become very sluggish.
+ * The viewer renders frame-buffer content only when there is new content, keyboard input, or
+ * terminal resize, and never more often than this many frames per second (adjustable by -maxfps).
+ * The governor lowers the rate as terminal gets larger and frames take longer. Rendering runs on its
+ * own thread, so controls stay responsive however long a frame takes, but a higher value costs more CPU.
  */
-#define VIEWER_FPS 10
-#define VIEWER_FRAME_INTVL_USEC (1000000 / VIEWER_FPS)
-#define VIEWER_MAX_INPUT_INTVL_USEC (1000000 / VIEWER_FPS)
+#define VIEWER_DEFAULT_MAX_FPS 25
+/* An escape key followed by another key within this interval is considered an Alt key combination. */
+#define VIEWER_ESC_COMBO_USEC 100000
+/* A frame rendered for outdated geometry is still shown if the screen has not changed for this long. */
+#define VIEWER_MAX_STALE_USEC 200000
+
+/* Net pan, zoom, and mouse movement of the control keys queued since they were last applied. */
+struct viewer_input {
+	int pan_x, pan_y, zoom;
+	int mouse_x, mouse_y;
+};
+
+/* Everything render thread needs to draw a frame, as seen by input thread. */
+struct viewer_scene {
+	struct geo geo;
+	/* Frame-buffer size is taken from the snapshot being rendered */
+	struct geo_facts facts;
+	char status[256];
+	/* Dithering algorithm chosen by the governor */
+	char algorithm[16];
+	/* Performance counters are only filled in if they are displayed */
+	char hud[PERF_HUD_LINES][PERF_HUD_WIDTH + 1];
+	bool disp_help, disp_perf, draw_mouse_pointer;
+	/* Only frame-buffer is drawn, without status row and mouse marker (viewer without display) */
+	bool bare;
+};
 
 /* Render remote frame-buffer on terminal and handle key/mouse IO. */
 struct viewer {
@@ -24,29 +54,130 @@ struct viewer {
 
 	caca_display_t *disp;
 	caca_canvas_t *view;
-	struct caca_dither *fb_dither;
+	struct render render;
+	/* Native terminal output, used in place of caca_refresh_display if native_output is set */
+	struct term term;
+	bool native_output;
+	/* Frames written to terminal are also recorded, if casting is set */
+	struct cast cast;
+	bool casting;
+	/*
+	 * A tile renders onto its canvas for the wall or headless output to show, the display (if any)
+	 * belongs to the wall. Pixels of terminal covered by the tile decide its aspect ratio.
+	 */
+	bool tile;
+	int tile_px_width, tile_px_height;
+
+	/* Input thread asks render thread for a new frame, it follows frame-buffer resize with geometry */
+	bool need_redraw;
+	struct geo_facts last_facts;
 
-	suseconds_t last_vnc_esc, last_viewer_control;
+	/*
+	 * Render thread draws the latest scene onto its own canvas, and hands a copy of the canvas
+	 * to input thread, which writes it to terminal (ncurses driver is not thread-safe).
+	 * The lock protects the scene, the handed-over canvas, and the flags in between. Render thread
+	 * wakes up by the condition, input thread by the pipe.
+	 */
+	pthread_t render_thread;
+	pthread_mutex_t render_lock;
+	pthread_cond_t render_cond;
+	bool cont_render;
+	struct viewer_scene scene;
+	/* Incremented when geometry of the scene changes */
+	unsigned long scene_seq;
+	bool scene_dirty, redraw_full;
+	caca_canvas_t *frame, *ready;
+	struct perf_frame ready_stats;
+	bool frame_ready;
+	unsigned long frames_dropped;
+	int frame_pipe[2];
+
+	/* Only touched by render thread while it runs */
+	struct geo_dither_params last_params;
+	long long frame_intvl, last_frame, last_shown;
+	bool marker_drawn;
+	int marker_ch_x, marker_ch_y;
+	/* Characters painted over by cursor shape, where, and which shape */
+	struct geo_rect cursor_rect;
+	int cursor_px_x, cursor_px_y;
+	unsigned long cursor_seq;
+	char last_status[256];
+
+	/* Performance counters, and the time at which the input being handled arrived */
+	struct perf perf;
+	/* Frame interval and dithering algorithm follow the governor, only used by input thread */
+	struct gov gov;
+	long long input_arrival;
+
+	/* Geometry control keys are merged into one change per batch of input */
+	struct viewer_input input;
+
+	long long last_vnc_esc;
 	bool void_backsp, void_tab, void_ret, void_pause, void_esc, void_del;
-	bool disp_help, input2vnc;
+	bool disp_help, disp_perf, input2vnc;
 	bool hold_lctrl, hold_lshift, hold_lalt, hold_lsuper, hold_ralt,
 	    hold_rshift, hold_rctrl;
 	bool draw_mouse_pointer;
 	bool mouse_left, mouse_middle, mouse_right;
 };
 
-/* Initialise viewer and its driver for the VNC connection. */
-bool viewer_init(struct viewer *v, struct vnc *vnc);
+/* Initialise viewer and its driver for the VNC connection, render on the threads of pool. */
+bool viewer_init(struct viewer *v, struct vnc *vnc, struct opt *opt,
+		 struct pool *pool);
+/*
+ * Initialise viewer of a wall tile, it shares display of the wall and has the size in characters
+ * (and in pixels of terminal covered by it). Return false only on failure.
+ */
+bool viewer_init_tile(struct viewer *v, struct vnc *vnc, struct opt *opt,
+		      struct pool *pool, caca_display_t * disp,
+		      int ch_width, int ch_height, int px_width,
+		      int px_height);
+/*
+ * Initialise viewer without display, which renders only frame-buffer onto its canvas of the size
+ * in characters (and pixels), and never touches remote mouse pointer. Return false only on failure.
+ */
+bool viewer_init_headless(struct viewer *v, struct vnc *vnc, struct opt *opt,
+			  struct pool *pool, int ch_width, int ch_height,
+			  int px_width, int px_height);
+/* Resize the tile of wall, the next frame is drawn in full. */
+void viewer_set_tile_size(struct viewer *v, int ch_width, int ch_height,
+			  int px_width, int px_height);
 /* Return geometry facts of the viewer. */
 struct geo_facts viewer_geo(struct viewer *v);
-/* Display a status row at 0,0. */
-void viewer_disp_status(struct viewer *v);
+/* Take the scene to be rendered from the current state of viewer. */
+void viewer_scene_of(struct viewer *v, struct viewer_scene *scene);
+/* Display the status row of scene at 0,0. */
+void viewer_disp_status(caca_canvas_t * canvas, struct viewer_scene *scene);
 /* Display a static help menu at 0,1. */
-void viewer_disp_help(struct viewer *v);
-/* Redraw the content from the latest frame-buffer of VNC connection. */
+void viewer_disp_help(caca_canvas_t * canvas);
+/* Display performance counters of scene at the top right corner, below status row. */
+void viewer_disp_perf(caca_canvas_t * canvas, struct viewer_scene *scene);
+/*
+ * Render the scene from the latest frame-buffer of VNC connection onto the canvas, and count the
+ * work into frame. Return false only on failure.
+ */
+bool viewer_render(struct viewer *v, struct viewer_scene *scene, bool full,
+		   caca_canvas_t * canvas, struct perf_frame *frame);
+/* Count the inputs that IO thread has sent to server since the previous frame. */
+void viewer_count_inputs(struct viewer *v);
+/* Redraw the content from the latest frame-buffer of VNC connection, block caller until it is on terminal. */
 void viewer_redraw(struct viewer *v);
-/* Handle keyboard input and canvas events. Block caller until quit key is pressed and handled. */
+/*
+ * Handle keyboard input and canvas events, while a render thread redraws the content.
+ * Block caller until quit key is pressed and handled.
+ */
 void viewer_ev_loop(struct viewer *v);
+/*
+ * The following queue events for VNC, and event loop sends everything queued in an iteration
+ * together (see vnc_flush_input).
+ */
+/* Direct the key stroke at VNC or at viewer controls, depending on who has input. Return false only if viewer should quit. */
+bool viewer_handle_key(struct viewer *v, int caca_key);
+/*
+ * Apply the queued controls, send a banked escape key once it is due, and send everything queued to VNC.
+ * Return the milliseconds until a banked escape key is due, or -1 if there is none.
+ */
+int viewer_flush_input(struct viewer *v);
 /* Click (press and release) a keyboard key in VNC. */
 void viewer_vnc_click_key(struct viewer *v, int vnc_key);
 /* Hold control key and then click the specified key in VNC, then release control key. */
@@ -57,7 +188,12 @@ void viewer_vnc_toggle_key(struct viewer *v, int vnc_key, bool key_down);
 void viewer_vnc_send_pointer(struct viewer *v);
 /* Translate caca key stroke to VNC key symbol and send it over VNC. */
 void viewer_input_to_vnc(struct viewer *v, int caca_key);
-/* Interpret and act on caca key stroke as a viewer control command. Return false only if viewer should quit. */
+/* Apply the queued pan, zoom, and mouse movement at once. Return true only if the view has changed. */
+bool viewer_apply_input(struct viewer *v);
+/*
+ * Interpret and act on caca key stroke as a viewer control command. Pan, zoom, and mouse movement
+ * are queued until viewer_apply_input. Return false only if viewer should quit.
+ */
 bool viewer_handle_control(struct viewer *v, int caca_key);
 /* Release all resources held by the viewer, but do not terminate the VNC connection. */
 void viewer_terminate(struct viewer *v);
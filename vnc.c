@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
 #include <sys/types.h>
 #include <rfb/keysym.h>
 #include <rfb/rfb.h>
@@ -9,6 +13,536 @@
 #include <caca.h>
 #include "vnc.h"
 
+/* Tag of struct vnc in the client data of RFB client. */
+static int vnc_client_data_tag;
+
+/* Return the struct vnc that owns the RFB client. */
+static struct vnc *vnc_of(struct _rfbClient *client)
+{
+	return (struct vnc *)rfbClientGetClientData(client,
+						    &vnc_client_data_tag);
+}
+
+/* Add a rectangle to the damage. */
+static void vnc_damage_add(struct vnc_damage *d, int x, int y, int w, int h)
+{
+	if (d->full) {
+		/* Nothing more to learn */
+	} else if (d->num_rects < VNC_MAX_DAMAGE_RECTS) {
+		struct vnc_rect *r = &d->rects[d->num_rects++];
+		r->x = x;
+		r->y = y;
+		r->w = w;
+		r->h = h;
+	} else {
+		/* Too many small rectangles, collapse them into a bounding box. */
+		struct vnc_rect *r = &d->rects[0];
+		int i, x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+		for (i = 0; i < d->num_rects; i++) {
+			if (d->rects[i].x < x1)
+				x1 = d->rects[i].x;
+			if (d->rects[i].y < y1)
+				y1 = d->rects[i].y;
+			if (d->rects[i].x + d->rects[i].w > x2)
+				x2 = d->rects[i].x + d->rects[i].w;
+			if (d->rects[i].y + d->rects[i].h > y2)
+				y2 = d->rects[i].y + d->rects[i].h;
+		}
+		r->x = x1;
+		r->y = y1;
+		r->w = x2 - x1;
+		r->h = y2 - y1;
+		d->num_rects = 1;
+	}
+}
+
+/* Add all of the damage from source to destination. */
+static void vnc_damage_merge(struct vnc_damage *dest, struct vnc_damage *src)
+{
+	int i;
+	if (src->full) {
+		dest->full = true;
+	}
+	for (i = 0; i < src->num_rects; i++) {
+		vnc_damage_add(dest, src->rects[i].x, src->rects[i].y,
+			       src->rects[i].w, src->rects[i].h);
+	}
+}
+
+/* Record a rectangle of frame-buffer updated by server. Called by IO thread. */
+static void got_fb_update(struct _rfbClient *client, int x, int y, int w,
+			  int h)
+{
+	struct vnc *vnc = vnc_of(client);
+	vnc_damage_add(&vnc->io_damage, x, y, w, h);
+	vnc->io_stats.rects++;
+}
+
+/* Scale a colour channel of the pixel value up to 8 bits. */
+static uint32_t vnc_channel_of(uint32_t px, int shift, int max)
+{
+	return (max == 0) ? 0 : ((px >> shift) & max) * 255 / max;
+}
+
+/* Build the translation table from pixels of lower depth to 32-bit snapshot pixels. Return false only on failure. */
+static bool vnc_build_px_table(struct vnc *vnc)
+{
+	rfbPixelFormat *fmt = &vnc->conn->format;
+	free(vnc->px_table);
+	vnc->px_table = NULL;
+	if (fmt->bitsPerPixel == 32) {
+		vnc->rmask = (uint32_t)fmt->redMax << fmt->redShift;
+		vnc->gmask = (uint32_t)fmt->greenMax << fmt->greenShift;
+		vnc->bmask = (uint32_t)fmt->blueMax << fmt->blueShift;
+		return true;
+	}
+	uint32_t px, num_px = (uint32_t)1 << fmt->bitsPerPixel;
+	vnc->px_table = malloc(num_px * sizeof(uint32_t));
+	if (!vnc->px_table) {
+		return false;
+	}
+	for (px = 0; px < num_px; px++) {
+		vnc->px_table[px] =
+		    vnc_channel_of(px, fmt->redShift, fmt->redMax) |
+		    vnc_channel_of(px, fmt->greenShift, fmt->greenMax) << 8 |
+		    vnc_channel_of(px, fmt->blueShift, fmt->blueMax) << 16;
+	}
+	vnc->rmask = 0x000000ff;
+	vnc->gmask = 0x0000ff00;
+	vnc->bmask = 0x00ff0000;
+	return true;
+}
+
+/* Note the request for the scale factor, whose answer is the unscaled frame-buffer of the size divided by the factor. */
+static void vnc_expect_scale(struct vnc *vnc, int scale, int width, int height)
+{
+	vnc->scale_sent = scale;
+	vnc->scale_answer_w = width * vnc->scale / scale;
+	vnc->scale_answer_h = height * vnc->scale / scale;
+}
+
+/* Return true only if frame-buffer of the size answers the pending scale request, allowing for rounding by server. */
+static bool vnc_is_scale_answer(struct vnc *vnc, int width, int height)
+{
+	return vnc->scale_sent != 0 && abs(width - vnc->scale_answer_w) <= 1
+	    && abs(height - vnc->scale_answer_h) <= 1;
+}
+
+/* Allocate frame-buffer and snapshot in the size told by server. Called by IO thread. */
+static rfbBool malloc_fb(struct _rfbClient *client)
+{
+	struct vnc *vnc = vnc_of(client);
+	int bytes_per_px = client->format.bitsPerPixel / 8;
+	size_t num_px = (size_t)client->width * client->height;
+	/* Renderer must not be looking at the snapshot */
+	pthread_mutex_lock(&vnc->fb_lock);
+	free(client->frameBuffer);
+	client->frameBuffer = malloc(num_px * bytes_per_px);
+	bool table_ok = vnc_build_px_table(vnc);
+	if (vnc->sharing) {
+		/* Consumers of shared memory see the new size together with the new pixels */
+		shm_begin(&vnc->shm);
+		vnc->snapshot = (uint8_t *) shm_resize(&vnc->shm, client->width,
+						       client->height,
+						       vnc->rmask, vnc->gmask,
+						       vnc->bmask);
+		if (vnc->snapshot != NULL) {
+			shm_end(&vnc->shm, NULL, 0, true);
+		}
+	} else {
+		free(vnc->snapshot);
+		vnc->snapshot = calloc(num_px, sizeof(uint32_t));
+	}
+	/* Size and scale change under both locks, geometry reads them under the request lock (see vnc_get_size) */
+	pthread_mutex_lock(&vnc->request_lock);
+	vnc->width = client->width;
+	vnc->height = client->height;
+	vnc->bytes_per_px = bytes_per_px;
+	/* Server resizes frame-buffer in response to a scale request, or when remote desktop is resized */
+	if (vnc_is_scale_answer(vnc, client->width, client->height)) {
+		vnc->scale = vnc->scale_sent;
+		vnc->scale_sent = 0;
+		vnc->scale_ignored = 0;
+	} else if (vnc->scale_sent != 0) {
+		/* Remote desktop has been resized at the current scale, the answer may still come for the new size */
+		vnc_expect_scale(vnc, vnc->scale_sent, client->width,
+				 client->height);
+	}
+	vnc->damage.full = true;
+	/* RFB client resets update requests to cover the new frame-buffer entirely */
+	vnc->viewport.x = 0;
+	vnc->viewport.y = 0;
+	vnc->viewport.w = client->width;
+	vnc->viewport.h = client->height;
+	vnc->viewport_changed = false;
+	pthread_mutex_unlock(&vnc->request_lock);
+	pthread_mutex_unlock(&vnc->fb_lock);
+	if (!client->frameBuffer || !vnc->snapshot || !table_ok) {
+		rfbClientErr("Failed to allocate frame-buffer of %dx%d\n",
+			     client->width, client->height);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Wake viewer up. Called by IO thread. */
+static void vnc_notify(struct vnc *vnc)
+{
+	char ch = 0;
+	if (write(vnc->notify_pipe[1], &ch, 1) == -1) {
+		/* The pipe is full, viewer is already due to wake up */
+	}
+}
+
+/* Translate a row of frame-buffer pixels into 32-bit snapshot pixels. */
+static void vnc_px_to_32(struct vnc *vnc, uint32_t *dest, const uint8_t *src,
+			 int num_px)
+{
+	int x;
+	if (vnc->px_table == NULL) {
+		memcpy(dest, src, (size_t)num_px * sizeof(uint32_t));
+	} else if (vnc->bytes_per_px == 2) {
+		const uint16_t *src16 = (const uint16_t *)src;
+		for (x = 0; x < num_px; x++) {
+			dest[x] = vnc->px_table[src16[x]];
+		}
+	} else {
+		for (x = 0; x < num_px; x++) {
+			dest[x] = vnc->px_table[src[x]];
+		}
+	}
+}
+
+/* Copy a rectangle of frame-buffer into snapshot. Caller must hold the frame-buffer lock. */
+static void vnc_copy_rect(struct vnc *vnc, struct vnc_rect *r)
+{
+	int x1 = r->x < 0 ? 0 : r->x;
+	int y1 = r->y < 0 ? 0 : r->y;
+	int x2 = r->x + r->w > vnc->width ? vnc->width : r->x + r->w;
+	int y2 = r->y + r->h > vnc->height ? vnc->height : r->y + r->h;
+	if (x2 <= x1 || y2 <= y1) {
+		return;
+	}
+	int y;
+	for (y = y1; y < y2; y++) {
+		size_t offset = (size_t)y * vnc->width + x1;
+		vnc_px_to_32(vnc, (uint32_t *) vnc->snapshot + offset,
+			     vnc->conn->frameBuffer +
+			     offset * vnc->bytes_per_px, x2 - x1);
+	}
+}
+
+/*
+ * Keep the cursor shape sent by server (in the pixel format of frame-buffer) for the next publication.
+ * Server no longer draws cursor into frame-buffer, viewer draws it instead. Called by IO thread.
+ */
+static void got_cursor_shape(struct _rfbClient *client, int xhot, int yhot,
+			     int width, int height, int bytes_per_px)
+{
+	struct vnc *vnc = vnc_of(client);
+	struct vnc_cursor *c = &vnc->io_cursor;
+	size_t num_px = (size_t)width * height;
+	if (!client->rcSource || !client->rcMask
+	    || bytes_per_px != vnc->bytes_per_px) {
+		return;
+	}
+	/* The buffers of a previously published shape are reused */
+	uint32_t *pixels = realloc(c->pixels, (num_px + 1) * sizeof(uint32_t));
+	if (pixels != NULL) {
+		c->pixels = pixels;
+	}
+	uint8_t *mask = realloc(c->mask, num_px + 1);
+	if (mask != NULL) {
+		c->mask = mask;
+	}
+	if (!pixels || !mask) {
+		rfbClientErr("Failed to allocate cursor of %dx%d\n", width,
+			     height);
+		/* Buffers may no longer fit the previous shape, show none */
+		c->width = 0;
+		c->height = 0;
+		vnc->io_cursor_changed = true;
+		return;
+	}
+	int y;
+	for (y = 0; y < height; y++) {
+		vnc_px_to_32(vnc, c->pixels + (size_t)y * width,
+			     client->rcSource +
+			     (size_t)y * width * bytes_per_px, width);
+	}
+	memcpy(c->mask, client->rcMask, num_px);
+	c->width = width;
+	c->height = height;
+	c->xhot = xhot;
+	c->yhot = yhot;
+	vnc->io_cursor_changed = true;
+}
+
+/*
+ * Copy the regions updated since the last publication into snapshot and wake viewer up.
+ * If viewer is busy rendering the snapshot, do nothing, and the updates will be published
+ * together with a later one. Called by IO thread.
+ */
+static void vnc_publish(struct vnc *vnc)
+{
+	struct vnc_damage *d = &vnc->io_damage;
+	if (vnc->io_updates == 0) {
+		return;
+	}
+	if (pthread_mutex_trylock(&vnc->fb_lock) != 0) {
+		return;
+	}
+	if (vnc->sharing) {
+		shm_begin(&vnc->shm);
+	}
+	int i;
+	if (d->full) {
+		struct vnc_rect all = { 0, 0, vnc->width, vnc->height };
+		vnc_copy_rect(vnc, &all);
+	} else {
+		for (i = 0; i < d->num_rects; i++) {
+			vnc_copy_rect(vnc, &d->rects[i]);
+		}
+	}
+	if (vnc->sharing) {
+		struct shm_rect dirty[VNC_MAX_DAMAGE_RECTS];
+		for (i = 0; i < d->num_rects; i++) {
+			dirty[i].x = d->rects[i].x;
+			dirty[i].y = d->rects[i].y;
+			dirty[i].w = d->rects[i].w;
+			dirty[i].h = d->rects[i].h;
+		}
+		shm_end(&vnc->shm, dirty, d->num_rects, d->full);
+	}
+	vnc_damage_merge(&vnc->damage, d);
+	if (vnc->io_cursor_changed) {
+		struct vnc_cursor shown = vnc->io_cursor;
+		shown.seq = vnc->cursor.seq + 1;
+		vnc->io_cursor = vnc->cursor;
+		vnc->cursor = shown;
+		vnc->io_cursor_changed = false;
+	}
+	vnc->stats.updates += vnc->io_stats.updates;
+	vnc->stats.rects += vnc->io_stats.rects;
+	vnc->stats.bytes += vnc->io_stats.bytes;
+	vnc->stats.decode_usec += vnc->io_stats.decode_usec;
+	memset(&vnc->io_stats, 0, sizeof(vnc->io_stats));
+	vnc->frames_published++;
+	vnc->frames_coalesced += vnc->io_updates - 1;
+	pthread_mutex_unlock(&vnc->fb_lock);
+	d->num_rects = 0;
+	d->full = false;
+	vnc->io_updates = 0;
+	vnc_notify(vnc);
+}
+
+/* Publish the completed frame-buffer update to viewer. Called by IO thread. */
+static void finished_fb_update(struct _rfbClient *client)
+{
+	struct vnc *vnc = vnc_of(client);
+	vnc->io_updates++;
+	vnc->io_stats.updates++;
+	vnc_publish(vnc);
+}
+
+/* Return true only if the outer rectangle contains the inner one. */
+static bool vnc_rect_contains(struct vnc_rect *outer, struct vnc_rect *inner)
+{
+	return inner->x >= outer->x && inner->y >= outer->y
+	    && inner->x + inner->w <= outer->x + outer->w
+	    && inner->y + inner->h <= outer->y + outer->h;
+}
+
+/* Restrict update requests to the latest viewport. Called by IO thread. Return false only on IO failure. */
+static bool vnc_apply_viewport(struct vnc *vnc)
+{
+	pthread_mutex_lock(&vnc->request_lock);
+	bool changed = vnc->viewport_changed;
+	struct vnc_rect rect = vnc->viewport;
+	vnc->viewport_changed = false;
+	pthread_mutex_unlock(&vnc->request_lock);
+	if (!changed) {
+		return true;
+	}
+	struct _rfbClient *c = vnc->conn;
+	struct vnc_rect old =
+	    { c->updateRect.x, c->updateRect.y, c->updateRect.w,
+		c->updateRect.h
+	};
+	c->updateRect.x = rect.x;
+	c->updateRect.y = rect.y;
+	c->updateRect.w = rect.w;
+	c->updateRect.h = rect.h;
+	/* Pixels outside of the old viewport have not been updated for a while, ask for all of them. */
+	if (!vnc_rect_contains(&old, &rect)) {
+		return SendFramebufferUpdateRequest(c, rect.x, rect.y, rect.w,
+						    rect.h, FALSE);
+	}
+	return true;
+}
+
+/* Return true only if server understands a scale request. */
+static bool vnc_can_scale(struct vnc *vnc)
+{
+	return SupportsClient2Server(vnc->conn, rfbSetScale)
+	    || SupportsClient2Server(vnc->conn, rfbPalmVNCSetScaleFactor);
+}
+
+/* Ask server to scale frame-buffer by the latest factor. Called by IO thread. Return false only on IO failure. */
+static bool vnc_apply_scale(struct vnc *vnc)
+{
+	pthread_mutex_lock(&vnc->request_lock);
+	int scale = vnc->scale_wanted;
+	pthread_mutex_unlock(&vnc->request_lock);
+	/* A server that never answers must not keep later zooms from asking again */
+	if (vnc->scale_sent != 0
+	    && perf_now_usec() - vnc->scale_sent_usec >=
+	    VNC_SCALE_TIMEOUT_USEC) {
+		vnc->scale_ignored = vnc->scale_sent;
+		vnc->scale_timeouts++;
+		vnc->scale_sent = 0;
+	}
+	/* Wait for server to respond to the previous request before asking again */
+	if (!vnc->server_scale || scale == 0 || scale == vnc->scale
+	    || scale == vnc->scale_ignored || vnc->scale_sent != 0
+	    || !vnc_can_scale(vnc)) {
+		return true;
+	}
+	vnc->scale_requests++;
+	vnc_expect_scale(vnc, scale, vnc->width, vnc->height);
+	vnc->scale_sent_usec = perf_now_usec();
+	return SendScaleSetting(vnc->conn, scale);
+}
+
+/*
+ * Read the number of bytes received so far from server. Socket of RFB client is one end of a socket
+ * pair while recording or replaying, which counts no bytes, so the count comes from the connection to
+ * server or from the replay server instead. Return false only if it is unknown.
+ */
+static bool vnc_bytes_received(struct vnc *vnc, unsigned long long *bytes)
+{
+	if (vnc->replay_bytes != NULL) {
+		*bytes = atomic_load(vnc->replay_bytes);
+		return true;
+	}
+	if (vnc->recording) {
+		return perf_socket_bytes(vnc->rec.server_fd, bytes);
+	}
+	return perf_socket_bytes(vnc->conn->sock, bytes);
+}
+
+/*
+ * Handle a server message, measure the CPU time spent on decoding it and the bytes received,
+ * and let tuning act on the measurement. Called by IO thread. Return false only on failure.
+ */
+static bool vnc_handle_message(struct vnc *vnc)
+{
+	long long begin = perf_now_usec();
+	long long begin_cpu = perf_clock_usec(CLOCK_THREAD_CPUTIME_ID);
+	if (!HandleRFBServerMessage(vnc->conn)) {
+		return false;
+	}
+	long long cpu = perf_clock_usec(CLOCK_THREAD_CPUTIME_ID) - begin_cpu;
+	long long wait = perf_now_usec() - begin - cpu;
+	vnc->io_stats.decode_usec += cpu;
+	unsigned long long bytes;
+	if (vnc_bytes_received(vnc, &bytes)) {
+		if (vnc->bytes_received != 0) {
+			vnc->io_stats.bytes += bytes - vnc->bytes_received;
+		}
+		vnc->bytes_received = bytes;
+	}
+	return tune_measure(&vnc->tune, vnc->conn, cpu, (wait > 0) ? wait : 0);
+}
+
+/* Send the events published by viewer in one write. Called by IO thread. Return false only on IO failure. */
+static bool vnc_send_queued(struct vnc *vnc)
+{
+	struct vnc_out_queue *q = &vnc->out;
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (head == tail) {
+		return true;
+	}
+	char buf[VNC_OUT_QUEUE_SIZE];
+	size_t len = head - tail;
+	size_t start = tail & (VNC_OUT_QUEUE_SIZE - 1);
+	size_t first = VNC_OUT_QUEUE_SIZE - start;
+	if (first > len) {
+		first = len;
+	}
+	memcpy(buf, q->buf + start, first);
+	memcpy(buf + first, q->buf, len - first);
+	atomic_store_explicit(&q->tail, head, memory_order_release);
+	q->writes++;
+	if (!WriteToRFBServer(vnc->conn, buf, len)) {
+		return false;
+	}
+	/* Latency of an input ends once its messages have been written, marks past the head wait for the next write */
+	long long now = perf_now_usec();
+	size_t mark_head =
+	    atomic_load_explicit(&q->mark_head, memory_order_acquire);
+	size_t mark_tail =
+	    atomic_load_explicit(&q->mark_tail, memory_order_relaxed);
+	unsigned long inputs = 0;
+	long long latency = 0;
+	while (mark_tail != mark_head) {
+		struct vnc_out_mark *m =
+		    &q->marks[mark_tail & (VNC_OUT_MARKS - 1)];
+		if (m->pos > head) {
+			break;
+		}
+		inputs++;
+		latency += now - m->arrival_usec;
+		mark_tail++;
+	}
+	atomic_store_explicit(&q->mark_tail, mark_tail, memory_order_release);
+	if (inputs > 0) {
+		pthread_mutex_lock(&vnc->request_lock);
+		vnc->inputs_sent += inputs;
+		vnc->input_latency_usec += latency;
+		pthread_mutex_unlock(&vnc->request_lock);
+	}
+	return true;
+}
+
+/*
+ * Wait for a server message or for viewer to publish events. Called by IO thread.
+ * Return 1 if server has sent something, 0 if not, or -1 on failure.
+ */
+static int vnc_wait(struct vnc *vnc, unsigned int timeout_usec)
+{
+	/*
+	 * RFB client may hold data that poll on the socket cannot see: bytes it has buffered, and
+	 * (in newer LibVNCClient) decrypted TLS or SASL data, which WaitForMessage checks for along
+	 * with the socket without blocking.
+	 */
+	if (vnc->conn->buffered > 0) {
+		return 1;
+	}
+	int ready = WaitForMessage(vnc->conn, 0);
+	if (ready < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	} else if (ready > 0) {
+		return 1;
+	}
+	struct pollfd fds[2] = {
+		{vnc->conn->sock, POLLIN, 0},
+		{vnc->wake_pipe[0], POLLIN, 0}
+	};
+	int num = poll(fds, 2, (timeout_usec + 999) / 1000);
+	if (num < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	if (fds[1].revents != 0) {
+		char buf[64];
+		while (read(vnc->wake_pipe[0], buf, sizeof(buf)) > 0) {
+			/* Consume the wake-ups, events are in the queue */
+		}
+	}
+	return (fds[0].revents != 0) ? 1 : 0;
+}
+
 /* Process RFB server messages, block caller. Return NULL. */
 static void *io_loop_fun(void *struct_vnc)
 {
@@ -17,53 +551,435 @@ static void *io_loop_fun(void *struct_vnc)
 		if (!vnc->cont_io_loop) {
 			break;
 		}
-		if (WaitForMessage(vnc->conn, VNC_POLL_TIMEOUT_USEC) < 0
-		    || !HandleRFBServerMessage(vnc->conn)) {
+		if (!vnc_apply_scale(vnc) || !vnc_apply_viewport(vnc)) {
+			rfbClientLog
+			    ("Error has occurred in the VNC IO routine\n");
+			vnc->connected = false;
+			vnc_notify(vnc);
+			break;
+		}
+		/* Come back soon to publish updates that viewer was too busy to take */
+		unsigned int timeout = VNC_POLL_TIMEOUT_USEC;
+		if (vnc->io_updates > 0) {
+			timeout = VNC_PUBLISH_RETRY_USEC;
+		}
+		int num_msgs = vnc_wait(vnc, timeout);
+		/* Viewer input goes out before decoding, which may take a while */
+		if (num_msgs < 0 || !vnc_send_queued(vnc)
+		    || (num_msgs > 0 && !vnc_handle_message(vnc))) {
 			rfbClientLog
 			    ("Error has occurred in the VNC IO routine\n");
 			vnc->connected = false;
+			vnc_notify(vnc);
 			break;
 		}
+		if (num_msgs == 0) {
+			vnc_publish(vnc);
+		}
 	}
 	return NULL;
 }
 
-bool vnc_init(struct vnc * v, int argc, char **argv)
+/* Release everything set up for the connection, the IO thread must not be running. */
+static void vnc_release(struct vnc *v)
+{
+	if (v->conn != NULL) {
+		uint8_t *fb = v->conn->frameBuffer;
+		rfbClientCleanup(v->conn);
+		free(fb);
+	}
+	if (v->sharing) {
+		shm_destroy(&v->shm);
+	} else {
+		free(v->snapshot);
+	}
+	free(v->px_table);
+	free(v->cursor.pixels);
+	free(v->cursor.mask);
+	free(v->io_cursor.pixels);
+	free(v->io_cursor.mask);
+	pthread_mutex_destroy(&v->fb_lock);
+	pthread_mutex_destroy(&v->request_lock);
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (v->notify_pipe[i] != -1) {
+			close(v->notify_pipe[i]);
+		}
+		if (v->wake_pipe[i] != -1) {
+			close(v->wake_pipe[i]);
+		}
+	}
+}
+
+/* Create RFB client with the settings, and everything viewer uses of a connection. Return false only on failure. */
+static bool vnc_setup(struct vnc *v, struct vnc_settings settings)
 {
 	memset(v, 0, sizeof(struct vnc));
+	v->notify_pipe[0] = v->notify_pipe[1] = -1;
+	v->wake_pipe[0] = v->wake_pipe[1] = -1;
+	v->scale = 1;
+	v->server_scale = settings.server_scale;
+	v->replay_bytes = settings.replay_bytes;
 	/*
-	 * The connection asks server for 32-bit RGB colours.
-	 * Take note that VNC does not use alpha channel, hence the most significant 2 bytes are useless.
-	 * I think 256-colours should be more than sufficient for this VNC client, but somehow I could not
-	 * get a sufficiently good quality out of dithering process, perhaps I got the bit-masks wrong?
+	 * The connection asks server for 32-bit RGB colours by default.
+	 * Take note that VNC does not use alpha channel, hence the most significant byte is useless.
+	 * A terminal cannot show most of the colours anyway, the lower depths cut network traffic
+	 * and frame-buffer memory at a small cost of colour accuracy. Their pixels are translated
+	 * into 32 bits by a table as they are copied into snapshot, see vnc_copy_rect.
 	 */
-	v->conn = rfbGetClient(8, 3, 4);
-	v->conn->canHandleNewFBSize = FALSE;
+	switch (settings.depth) {
+	case VNC_DEPTH_16:
+		v->conn = rfbGetClient(5, 3, 2);
+		v->conn->format.depth = 16;
+		v->conn->format.redMax = 31;
+		v->conn->format.greenMax = 63;
+		v->conn->format.blueMax = 31;
+		v->conn->format.redShift = 11;
+		v->conn->format.greenShift = 5;
+		v->conn->format.blueShift = 0;
+		break;
+	case VNC_DEPTH_8:
+		v->conn = rfbGetClient(2, 3, 1);
+		v->conn->format.depth = 8;
+		v->conn->format.redMax = 7;
+		v->conn->format.greenMax = 7;
+		v->conn->format.blueMax = 3;
+		v->conn->format.redShift = 0;
+		v->conn->format.greenShift = 3;
+		v->conn->format.blueShift = 6;
+		break;
+	default:
+		v->conn = rfbGetClient(8, 3, 4);
+	}
+	pthread_mutex_init(&v->fb_lock, NULL);
+	pthread_mutex_init(&v->request_lock, NULL);
+	if (!v->conn) {
+		fprintf(stderr, "Failed to create VNC client\n");
+		vnc_release(v);
+		return false;
+	}
+	/* Command line options of LibVNCClient override the initial encodings */
+	tune_init(&v->tune, settings.tuning, v->conn);
+	/* Server resizes frame-buffer when it scales, snapshot and viewer follow the new size */
+	v->conn->canHandleNewFBSize = TRUE;
+	rfbClientSetClientData(v->conn, &vnc_client_data_tag, v);
+	v->conn->GotFrameBufferUpdate = got_fb_update;
+	v->conn->FinishedFrameBufferUpdate = finished_fb_update;
+	v->conn->MallocFrameBuffer = malloc_fb;
+	/* Pointer moves need no update from server if it sends cursor shape (RichCursor or XCursor) */
+	if (settings.local_cursor) {
+		v->conn->appData.useRemoteCursor = TRUE;
+		v->conn->GotCursorShape = got_cursor_shape;
+	}
+	if (pipe(v->notify_pipe) != 0 || pipe(v->wake_pipe) != 0) {
+		fprintf(stderr, "Failed to create notification pipe\n");
+		vnc_release(v);
+		return false;
+	}
+	fcntl(v->notify_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(v->notify_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(v->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(v->wake_pipe[1], F_SETFL, O_NONBLOCK);
+	/* Viewer has not seen anything yet */
+	v->damage.full = true;
+	v->io_damage.full = true;
+	return true;
+}
+
+bool vnc_init(struct vnc * v, struct vnc_settings settings, int argc,
+	      char **argv)
+{
+	if (!vnc_setup(v, settings)) {
+		return false;
+	}
+	if (settings.shm_name != NULL) {
+		if (!shm_init(&v->shm, settings.shm_name)) {
+			vnc_release(v);
+			return false;
+		}
+		v->sharing = true;
+	}
 	if (!rfbInitClient(v->conn, &argc, argv)) {
+		/* LibVNCClient frees its client on failure */
+		v->conn = NULL;
+		vnc_release(v);
 		return false;
 	}
+	/* A fixed scale asked for by -scale option of LibVNCClient takes precedence */
+	if (v->conn->appData.scaleSetting > 1) {
+		v->server_scale = false;
+		vnc_expect_scale(v, v->conn->appData.scaleSetting,
+				 v->conn->width, v->conn->height);
+		v->scale_sent_usec = perf_now_usec();
+	}
+	if (settings.record_path != NULL) {
+		if (!rec_start(&v->rec, settings.record_path, v->conn,
+			       settings.depth)) {
+			vnc_release(v);
+			return false;
+		}
+		v->recording = true;
+	}
 	v->cont_io_loop = true;
 	v->connected = true;
 	if (pthread_create(&v->io_loop, NULL, io_loop_fun, (void *)v) != 0) {
 		fprintf(stderr, "Failed to create message loop thread\n");
+		v->cont_io_loop = false;
+		v->connected = false;
+		if (v->recording) {
+			rec_stop(&v->rec);
+		}
+		vnc_release(v);
+		return false;
+	}
+	return true;
+}
+
+bool vnc_init_disconnected(struct vnc *v, struct vnc_settings settings,
+			   const char *host)
+{
+	if (!vnc_setup(v, settings)) {
 		return false;
 	}
+	/* Status row names the server like LibVNCClient does, host:display or host::port */
+	const char *colon = strchr(host, ':');
+	free(v->conn->serverHost);
+	v->conn->serverHost =
+	    colon ? strndup(host, colon - host) : strdup(host);
+	if (colon && colon[1] == ':') {
+		v->conn->serverPort = atoi(colon + 2);
+	} else if (colon) {
+		v->conn->serverPort = atoi(colon + 1);
+		if (v->conn->serverPort < 100) {
+			v->conn->serverPort += 5900;
+		}
+	}
 	return true;
 }
 
 void vnc_destroy(struct vnc *v)
 {
+	bool io_running = v->cont_io_loop;
 	v->cont_io_loop = false;
 	v->connected = false;
-	if (pthread_join(v->io_loop, NULL) != 0) {
+	if (io_running && pthread_join(v->io_loop, NULL) != 0) {
 		fprintf(stderr, "Failed to join message loop thread\n");
 	}
-	uint8_t *fb = v->conn->frameBuffer;
-	rfbClientCleanup(v->conn);
-	free(fb);
+	if (v->recording) {
+		rec_stop(&v->rec);
+	}
+	rfbClientLog
+	    ("Frames: %lu published, %lu coalesced while viewer was busy, %lu replaced before viewer rendered them\n",
+	     v->frames_published, v->frames_coalesced, v->frames_skipped);
+	if (v->out.writes > 0 || v->out.dropped > 0) {
+		rfbClientLog
+		    ("Input: %lu events sent in %lu writes, %lu dropped while IO thread was stuck\n",
+		     v->out.messages, v->out.writes, v->out.dropped);
+	}
+	if (v->scale_requests > 0) {
+		rfbClientLog
+		    ("Scaling: down by %d at last, %lu requests sent, %lu of them not answered in time\n",
+		     v->scale, v->scale_requests, v->scale_timeouts);
+	}
+	if (v->tune.mode != TUNE_OFF) {
+		rfbClientLog
+		    ("Encodings: %s at last, switched %lu times, decoding %.1fms and network wait %.1fms per message\n",
+		     v->tune.preset->name, v->tune.switches,
+		     v->tune.avg_cpu_usec / 1000, v->tune.avg_wait_usec / 1000);
+	}
+	vnc_release(v);
 	rfbClientLog("VNC connection has been terminated\n");
 }
 
+int vnc_notify_fd(struct vnc *v)
+{
+	return v->notify_pipe[0];
+}
+
+bool vnc_take_notification(struct vnc *v)
+{
+	char buf[64];
+	bool notified = false;
+	while (read(v->notify_pipe[0], buf, sizeof(buf)) > 0) {
+		notified = true;
+	}
+	return notified;
+}
+
+void vnc_set_viewport(struct vnc *v, struct vnc_rect rect)
+{
+	pthread_mutex_lock(&v->request_lock);
+	if (memcmp(&rect, &v->viewport, sizeof(rect)) != 0) {
+		v->viewport = rect;
+		v->viewport_changed = true;
+	}
+	pthread_mutex_unlock(&v->request_lock);
+}
+
+void vnc_set_scale(struct vnc *v, int scale)
+{
+	if (scale < 1) {
+		scale = 1;
+	} else if (scale > VNC_MAX_SCALE) {
+		scale = VNC_MAX_SCALE;
+	}
+	pthread_mutex_lock(&v->request_lock);
+	v->scale_wanted = scale;
+	pthread_mutex_unlock(&v->request_lock);
+}
+
+/*
+ * Append a client message to the queue, wait for IO thread to make room if it is full. The wait is
+ * bounded, so that a write blocked by a stalled server does not keep viewer from handling quit keys.
+ * Return false only if connection has been lost or the message has been dropped.
+ */
+static bool vnc_queue(struct vnc *v, const void *msg, size_t len)
+{
+	struct vnc_out_queue *q = &v->out;
+	long long deadline = 0;
+	while (q->pending + len -
+	       atomic_load_explicit(&q->tail, memory_order_acquire) >
+	       VNC_OUT_QUEUE_SIZE) {
+		if (!v->connected) {
+			return false;
+		}
+		/* Once IO thread is stuck, the events after the dropped one are dropped without waiting again */
+		long long now = perf_now_usec();
+		if (deadline == 0) {
+			deadline = now + VNC_OUT_QUEUE_TIMEOUT_USEC;
+		}
+		if (q->stalled || now >= deadline) {
+			q->stalled = true;
+			q->dropped++;
+			return false;
+		}
+		/* Hand over what has been queued so far, and give IO thread a moment to send it */
+		vnc_flush_input(v);
+		usleep(VNC_OUT_QUEUE_RETRY_USEC);
+	}
+	q->stalled = false;
+	const uint8_t *bytes = msg;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		q->buf[(q->pending + i) & (VNC_OUT_QUEUE_SIZE - 1)] = bytes[i];
+	}
+	q->pending += len;
+	q->messages++;
+	return true;
+}
+
+bool vnc_queue_key(struct vnc *v, uint32_t key, bool down)
+{
+	if (!SupportsClient2Server(v->conn, rfbKeyEvent)) {
+		return true;
+	}
+	rfbKeyEventMsg ke;
+	memset(&ke, 0, sizeof(ke));
+	ke.type = rfbKeyEvent;
+	ke.down = down ? 1 : 0;
+	ke.key = htonl(key);
+	return vnc_queue(v, &ke, sz_rfbKeyEventMsg);
+}
+
+bool vnc_queue_pointer(struct vnc *v, int x, int y, int button_mask)
+{
+	if (!SupportsClient2Server(v->conn, rfbPointerEvent)) {
+		return true;
+	}
+	rfbPointerEventMsg pe;
+	memset(&pe, 0, sizeof(pe));
+	pe.type = rfbPointerEvent;
+	pe.buttonMask = button_mask;
+	pe.x = htons(x < 0 ? 0 : x);
+	pe.y = htons(y < 0 ? 0 : y);
+	return vnc_queue(v, &pe, sz_rfbPointerEventMsg);
+}
+
+void vnc_mark_input(struct vnc *v, long long arrival_usec)
+{
+	struct vnc_out_queue *q = &v->out;
+	/* An input of no message (e.g. server takes no pointer events) is never sent */
+	if (q->pending == q->marked) {
+		return;
+	}
+	q->marked = q->pending;
+	/* With the ring full, the input goes out uncounted */
+	if (q->mark_pending -
+	    atomic_load_explicit(&q->mark_tail, memory_order_acquire) >=
+	    VNC_OUT_MARKS) {
+		return;
+	}
+	struct vnc_out_mark *m = &q->marks[q->mark_pending & (VNC_OUT_MARKS - 1)];
+	m->pos = q->pending;
+	m->arrival_usec = arrival_usec;
+	q->mark_pending++;
+}
+
+void vnc_flush_input(struct vnc *v)
+{
+	struct vnc_out_queue *q = &v->out;
+	if (atomic_load_explicit(&q->head, memory_order_relaxed) == q->pending) {
+		return;
+	}
+	/* Marks go out before the bytes they refer to */
+	atomic_store_explicit(&q->mark_head, q->mark_pending,
+			      memory_order_release);
+	atomic_store_explicit(&q->head, q->pending, memory_order_release);
+	char ch = 0;
+	if (write(v->wake_pipe[1], &ch, 1) == -1) {
+		/* The pipe is full, IO thread is already due to wake up */
+	}
+}
+
+void vnc_take_inputs(struct vnc *v, unsigned long *inputs,
+		     long long *latency_usec)
+{
+	pthread_mutex_lock(&v->request_lock);
+	*inputs = v->inputs_sent;
+	*latency_usec = v->input_latency_usec;
+	v->inputs_sent = 0;
+	v->input_latency_usec = 0;
+	pthread_mutex_unlock(&v->request_lock);
+}
+
+void vnc_get_size(struct vnc *v, int *width, int *height, int *scale)
+{
+	/* Request lock is never held for long, unlike the snapshot that render thread may keep locked */
+	pthread_mutex_lock(&v->request_lock);
+	*width = v->width;
+	*height = v->height;
+	*scale = v->scale;
+	pthread_mutex_unlock(&v->request_lock);
+}
+
+void vnc_lock_frame(struct vnc *v, struct vnc_damage *dest)
+{
+	pthread_mutex_lock(&v->fb_lock);
+	memcpy(dest, &v->damage, sizeof(struct vnc_damage));
+	v->damage.num_rects = 0;
+	v->damage.full = false;
+	if (v->frames_published > v->frames_seen + 1) {
+		v->frames_skipped += v->frames_published - v->frames_seen - 1;
+		v->stats.skipped += v->frames_published - v->frames_seen - 1;
+	}
+	v->frames_seen = v->frames_published;
+}
+
+void vnc_take_stats(struct vnc *v, struct perf_frame *dest)
+{
+	dest->updates += v->stats.updates;
+	dest->rects += v->stats.rects;
+	dest->bytes += v->stats.bytes;
+	dest->skipped += v->stats.skipped;
+	dest->decode_usec += v->stats.decode_usec;
+	memset(&v->stats, 0, sizeof(v->stats));
+}
+
+void vnc_unlock_frame(struct vnc *v)
+{
+	pthread_mutex_unlock(&v->fb_lock);
+}
+
 int cacakey2vnc(int caca_key)
 {
 	/* Ordinary visible characters in ASCII table do not require translation */
@@ -1,22 +1,213 @@
 #ifndef VNC_H
 #define VNC_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <rfb/rfbclient.h>
+#include "perf.h"
+#include "rec.h"
+#include "shm.h"
+#include "tune.h"
 
 #define VNC_POLL_TIMEOUT_USEC 100000	/* A lower value enables faster termination of VNC IO loop */
+#define VNC_PUBLISH_RETRY_USEC 2000	/* Retry publishing updates this soon if renderer was busy */
+#define VNC_MAX_DAMAGE_RECTS 64	/* Beyond this many rectangles, damage collapses into their bounding box */
+#define VNC_MAX_SCALE 8		/* Server never has to scale frame-buffer down further than this */
+#define VNC_SCALE_TIMEOUT_USEC 3000000	/* A scale request not answered for this long is taken as ignored by server */
+#define VNC_OUT_QUEUE_SIZE 4096	/* Bytes of client messages queued by viewer, must be a power of two */
+#define VNC_OUT_QUEUE_RETRY_USEC 1000	/* Viewer waits this long for room in a full queue before trying again */
+#define VNC_OUT_QUEUE_TIMEOUT_USEC 200000	/* Viewer drops an event if the queue stays full for this long */
+#define VNC_OUT_MARKS 256	/* Inputs awaiting IO thread whose latency is counted, must be a power of two */
+
+/* Pixel format requested from server, see struct vnc for how viewer gets them. */
+enum vnc_depth {
+	VNC_DEPTH_32,		/* 32-bit RGB888 */
+	VNC_DEPTH_16,		/* 16-bit RGB565 */
+	VNC_DEPTH_8		/* 8-bit BGR233 */
+};
+
+/* How to connect to server, see vnc_init. */
+struct vnc_settings {
+	enum vnc_depth depth;
+	/* Ask server to scale frame-buffer down when zoomed out, if server supports scaling */
+	bool server_scale;
+	enum tune_mode tuning;
+	/* Record what server sends into this file, NULL if not wanted */
+	const char *record_path;
+	/* Place snapshot in the named shared memory for local tools, NULL if not wanted */
+	const char *shm_name;
+	/* Ask server for the shape of mouse cursor instead of having it drawn into frame-buffer */
+	bool local_cursor;
+	/* Bytes sent by the replay server in this process (see struct rec_replay), NULL if not replaying */
+	atomic_ullong *replay_bytes;
+};
+
+/* A rectangle of frame-buffer pixels. */
+struct vnc_rect {
+	int x, y, w, h;
+};
+
+/* Frame-buffer regions updated by server since they were last looked at. */
+struct vnc_damage {
+	struct vnc_rect rects[VNC_MAX_DAMAGE_RECTS];
+	int num_rects;
+	bool full;
+};
+
+/* Shape of mouse cursor sent by server, its pixels are 32 bits of the snapshot colour masks. */
+struct vnc_cursor {
+	int width, height, xhot, yhot;
+	uint32_t *pixels;
+	/* A byte per pixel, non-zero where cursor is opaque */
+	uint8_t *mask;
+	/* Incremented whenever the shape changes */
+	unsigned long seq;
+};
+
+/*
+ * Key and pointer events queued by viewer for IO thread to send. It is a ring of bytes without a
+ * lock: viewer is the only producer and IO thread the only consumer. Viewer appends messages
+ * past the head, and publishes them all at once by moving the head. IO thread sends everything
+ * up to the head in a single write, and then moves the tail. Positions only ever grow, the ring
+ * index is the position modulo queue size.
+ */
+struct vnc_out_mark {
+	/* Position past the messages of an input, and the time at which it arrived at the viewer */
+	size_t pos;
+	long long arrival_usec;
+};
+
+struct vnc_out_queue {
+	uint8_t buf[VNC_OUT_QUEUE_SIZE];
+	atomic_size_t head, tail;
+	/* Position past the latest appended message, and whether IO thread has stopped making room, only touched by viewer */
+	size_t pending;
+	bool stalled;
+	/*
+	 * Marks of the inputs, a ring published and consumed like the bytes. IO thread counts the
+	 * latency of an input once the write carrying its messages returns.
+	 */
+	struct vnc_out_mark marks[VNC_OUT_MARKS];
+	atomic_size_t mark_head, mark_tail;
+	size_t mark_pending, marked;
+	/* Messages appended by viewer, those dropped because the queue stayed full, and writes done by IO thread */
+	unsigned long messages, dropped, writes;
+};
 
 /* Connect to remote frame-buffer and handle control/image IO. */
 struct vnc {
 	struct _rfbClient *conn;
 	bool connected, cont_io_loop;
 	pthread_t io_loop;
+
+	/*
+	 * Server updates are decoded into the frame-buffer of RFB client. Once an update completes,
+	 * its regions are copied into the snapshot, which is what viewer renders. The lock protects
+	 * snapshot and its damage, and IO thread never waits for it while viewer is rendering.
+	 * Snapshot pixels are always 32 bits of the colour masks, pixels of lower depth are
+	 * translated by table while being copied.
+	 */
+	pthread_mutex_t fb_lock;
+	uint8_t *snapshot;
+	/* Size and scale are also protected by the request lock, so that viewer reads them without waiting for rendering */
+	int width, height, bytes_per_px;
+	/* Frame-buffer is scaled down by server by this factor, 1 if not scaled */
+	int scale;
+	uint32_t rmask, gmask, bmask;
+	/* 32-bit snapshot pixel of every pixel value of lower depth, NULL if frame-buffer is 32-bit */
+	uint32_t *px_table;
+	struct vnc_damage damage;
+	/* Updates decoded but not yet copied into snapshot, only touched by IO thread */
+	struct vnc_damage io_damage;
+	int io_updates;
+	/* Cursor shape goes along with snapshot, a new shape waits for the next publication like updates do */
+	struct vnc_cursor cursor, io_cursor;
+	bool io_cursor_changed;
+	/* Updates copied into snapshot together with others, and snapshots replaced before viewer rendered them */
+	unsigned long frames_published, frames_coalesced, frames_skipped,
+	    frames_seen;
+	/* Work done for the updates in snapshot, and for the updates not yet copied (only touched by IO thread) */
+	struct perf_frame stats, io_stats;
+	unsigned long long bytes_received;
+	atomic_ullong *replay_bytes;
+
+	/*
+	 * Incremental update requests cover only the viewport, the frame-buffer region visible in viewer,
+	 * and server scales frame-buffer down as much as viewer asks for. Viewer sets them, and IO thread
+	 * applies them before handling the next message.
+	 */
+	pthread_mutex_t request_lock;
+	struct vnc_rect viewport;
+	bool viewport_changed;
+	bool server_scale;
+	int scale_wanted, scale_sent;
+	/*
+	 * Only IO thread touches the following. Frame-buffer of this size answers the pending scale request,
+	 * and server is taken to ignore the factor once the request has waited too long.
+	 */
+	int scale_answer_w, scale_answer_h, scale_ignored;
+	long long scale_sent_usec;
+	/* Scale requests sent, and those that were not answered in time, reported on exit */
+	unsigned long scale_requests, scale_timeouts;
+
+	/* Choice of encodings, only touched by IO thread after connecting */
+	struct tune tune;
+	/* Recording of the session, only used if recording is set */
+	struct rec rec;
+	bool recording;
+	/* Snapshot lives in shared memory, only used if sharing is set */
+	struct shm shm;
+	bool sharing;
+
+	/* Key and pointer events from viewer, viewer writes to the pipe to wake IO thread up for them */
+	struct vnc_out_queue out;
+	int wake_pipe[2];
+	/* Inputs sent by IO thread and the sum of their latency, protected by the request lock */
+	unsigned long inputs_sent;
+	long long input_latency_usec;
+
+	/* IO thread writes to the pipe to wake viewer up when an update completes or connection is lost */
+	int notify_pipe[2];
 };
 
-/* Connect to server and immediately begin message loop in a separate thread. Return false only on failure. */
-bool vnc_init(struct vnc *v, int argc, char **argv);
+/* Connect to server with the settings, and immediately begin message loop in a separate thread. Return false only on failure. */
+bool vnc_init(struct vnc *v, struct vnc_settings settings, int argc,
+	      char **argv);
+/*
+ * Set up a connection to the host (host:display or host::port) that could not be established, which
+ * viewer shows as disconnected. Return false only on failure.
+ */
+bool vnc_init_disconnected(struct vnc *v, struct vnc_settings settings,
+			   const char *host);
 /* Close VNC connection and free all resources, including the VNC client itself. */
 void vnc_destroy(struct vnc *v);
+/* Return the file descriptor that becomes readable when viewer has something new to show. */
+int vnc_notify_fd(struct vnc *v);
+/* Consume pending notifications. Return true only if there was any. */
+bool vnc_take_notification(struct vnc *v);
+/* Restrict update requests to the rectangle of frame-buffer, the entire frame-buffer lifts the restriction. */
+void vnc_set_viewport(struct vnc *v, struct vnc_rect rect);
+/* Ask server to scale frame-buffer down by the factor (1 - VNC_MAX_SCALE), if server supports scaling. */
+void vnc_set_scale(struct vnc *v, int scale);
+/* Queue a key press or release. Return false only if connection has been lost or IO thread is stuck. */
+bool vnc_queue_key(struct vnc *v, uint32_t key, bool down);
+/* Queue a pointer movement with the buttons (bit mask) held down. Return false only if connection has been lost or IO thread is stuck. */
+bool vnc_queue_pointer(struct vnc *v, int x, int y, int button_mask);
+/* Mark the events queued since the previous mark as one input, which arrived at the viewer at the time. */
+void vnc_mark_input(struct vnc *v, long long arrival_usec);
+/* Hand the queued events over to IO thread, which sends them in one write. */
+void vnc_flush_input(struct vnc *v);
+/* Move the number of inputs sent to server since the last call, and the sum of their latency, into the destination. */
+void vnc_take_inputs(struct vnc *v, unsigned long *inputs,
+		     long long *latency_usec);
+/* Read the size of snapshot, and the factor server scales it down by, as IO thread last set them together. */
+void vnc_get_size(struct vnc *v, int *width, int *height, int *scale);
+/* Lock snapshot for rendering, and move its damage accumulated so far into the destination. */
+void vnc_lock_frame(struct vnc *v, struct vnc_damage *dest);
+/* Add the work done for the locked snapshot since the last call into the destination. */
+void vnc_take_stats(struct vnc *v, struct perf_frame *dest);
+/* Let IO thread update snapshot again. */
+void vnc_unlock_frame(struct vnc *v);
 /* Translate a key code as read by libcaca to its corresponding VNC key code. Return -1 only if no translation. */
 int cacakey2vnc(int keych);
 
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "wall.h"
+
+/* Return the pixels of terminal covered by a number of characters, on one axis. */
+static int wall_px_of(int px_total, int ch, int ch_total)
+{
+	return (ch_total > 0) ? (long long)px_total * ch / ch_total : 0;
+}
+
+/* Lay the tiles out in a grid covering canvas of the wall, and resize their viewers if they are running. */
+static void wall_layout(struct wall *w, bool resize_viewers)
+{
+	int ch_width = caca_get_canvas_width(w->view);
+	int ch_height = caca_get_canvas_height(w->view);
+	int px_width = caca_get_display_width(w->disp);
+	int px_height = caca_get_display_height(w->disp);
+	int cols = 1;
+	while (cols * cols < w->num_tiles) {
+		cols++;
+	}
+	int rows = (w->num_tiles + cols - 1) / cols;
+	int i;
+	for (i = 0; i < w->num_tiles; i++) {
+		struct wall_tile *t = &w->tiles[i];
+		int col = i % cols, row = i / cols;
+		t->rect.x = col * ch_width / cols;
+		t->rect.y = row * ch_height / rows;
+		t->rect.width = (col + 1) * ch_width / cols - t->rect.x;
+		t->rect.height = (row + 1) * ch_height / rows - t->rect.y;
+		t->dirty = true;
+		if (resize_viewers) {
+			viewer_set_tile_size(&t->viewer, t->rect.width,
+					     t->rect.height,
+					     wall_px_of(px_width, t->rect.width,
+							ch_width),
+					     wall_px_of(px_height,
+							t->rect.height,
+							ch_height));
+		}
+	}
+}
+
+/* Release what wall_init has set up so far, the viewers of the tiles before the number included. Return false. */
+static bool wall_fail(struct wall *w, int num_viewers)
+{
+	int i;
+	for (i = 0; i < num_viewers; i++) {
+		viewer_terminate(&w->tiles[i].viewer);
+	}
+	if (w->native_output) {
+		term_destroy(&w->term);
+	}
+	if (w->disp != NULL) {
+		caca_free_display(w->disp);
+	}
+	if (w->view != NULL) {
+		caca_free_canvas(w->view);
+	}
+	for (i = 0; i < w->num_tiles; i++) {
+		vnc_destroy(&w->tiles[i].vnc);
+	}
+	free(w->tiles);
+	memset(w, 0, sizeof(struct wall));
+	return false;
+}
+
+bool wall_init(struct wall *w, struct opt *opt, struct pool *pool,
+	       int num_hosts, char **hosts, int argc, char **argv)
+{
+	memset(w, 0, sizeof(struct wall));
+	if (num_hosts > WALL_MAX_TILES) {
+		fprintf(stderr, "A wall shows at most %d servers\n",
+			WALL_MAX_TILES);
+		return false;
+	}
+	w->tiles = calloc(num_hosts, sizeof(struct wall_tile));
+	/* LibVNCClient consumes its options from command line, every connection takes a copy */
+	char **tile_argv = malloc((argc + 2) * sizeof(char *));
+	if (!w->tiles || !tile_argv) {
+		fprintf(stderr, "Failed to allocate tiles\n");
+		free(tile_argv);
+		return wall_fail(w, 0);
+	}
+	w->frame_intvl = 1000000 / opt->max_fps;
+	w->unfocused_intvl = 1000000 / WALL_UNFOCUSED_FPS;
+	if (w->unfocused_intvl < w->frame_intvl) {
+		w->unfocused_intvl = w->frame_intvl;
+	}
+	int i;
+	for (i = 0; i < num_hosts; i++) {
+		memcpy(tile_argv, argv, argc * sizeof(char *));
+		tile_argv[argc] = hosts[i];
+		tile_argv[argc + 1] = NULL;
+		/* An unreachable server leaves its tile disconnected, like a connection lost later on */
+		if (!vnc_init(&w->tiles[i].vnc, opt->vnc, argc + 1, tile_argv)
+		    && !vnc_init_disconnected(&w->tiles[i].vnc, opt->vnc,
+					      hosts[i])) {
+			free(tile_argv);
+			return wall_fail(w, 0);
+		}
+		w->num_tiles++;
+	}
+	free(tile_argv);
+	w->view = caca_create_canvas(0, 0);
+	if (!w->view) {
+		fprintf(stderr, "Failed to create caca canvas\n");
+		return wall_fail(w, 0);
+	}
+	w->disp = caca_create_display_with_driver(w->view,
+						  opt->display_driver);
+	if (!w->disp) {
+		fprintf(stderr, "Failed to create caca display\n");
+		return wall_fail(w, 0);
+	}
+	if (opt->output == TERM_OUTPUT_NATIVE) {
+		/* See viewer_init, ncurses paints its blank screen first */
+		caca_refresh_display(w->disp);
+		w->native_output = term_init(&w->term, STDOUT_FILENO,
+					     opt->colours);
+		if (!w->native_output) {
+			return wall_fail(w, 0);
+		}
+	}
+	caca_set_display_title(w->disp, "headmore wall");
+	wall_layout(w, false);
+	int ch_width = caca_get_canvas_width(w->view);
+	int ch_height = caca_get_canvas_height(w->view);
+	for (i = 0; i < w->num_tiles; i++) {
+		struct wall_tile *t = &w->tiles[i];
+		if (!viewer_init_tile(&t->viewer, &t->vnc, opt, pool, w->disp,
+				      t->rect.width, t->rect.height,
+				      wall_px_of(caca_get_display_width
+						 (w->disp), t->rect.width,
+						 ch_width),
+				      wall_px_of(caca_get_display_height
+						 (w->disp), t->rect.height,
+						 ch_height))) {
+			return wall_fail(w, i);
+		}
+	}
+	return true;
+}
+
+/* Render the tile and place it on canvas of the wall. Return false only on failure. */
+static bool wall_render_tile(struct wall *w, int i)
+{
+	struct wall_tile *t = &w->tiles[i];
+	struct viewer *v = &t->viewer;
+	struct viewer_scene scene;
+	struct perf_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	viewer_scene_of(v, &scene);
+	bool full = v->redraw_full;
+	v->redraw_full = false;
+	if (!viewer_render(v, &scene, full, v->frame, &frame)) {
+		v->redraw_full = true;
+		return false;
+	}
+	viewer_count_inputs(v);
+	perf_frame_done(&v->perf, &frame);
+	caca_blit(w->view, t->rect.x, t->rect.y, v->frame, NULL);
+	/* Status row of the focused tile stands out across the whole tile */
+	if (i == w->focus) {
+		caca_set_color_ansi(w->view, CACA_WHITE, CACA_RED);
+		caca_printf(w->view, t->rect.x, t->rect.y, "%-*.*s",
+			    t->rect.width, t->rect.width, scene.status);
+	}
+	return true;
+}
+
+/* Write canvas of the wall to terminal. */
+static void wall_output(struct wall *w)
+{
+	if (w->native_output) {
+		term_refresh(&w->term, w->view);
+	} else {
+		caca_refresh_display(w->disp);
+	}
+}
+
+void wall_ev_loop(struct wall *w)
+{
+	int ev_accept =
+	    CACA_EVENT_KEY_PRESS | CACA_EVENT_RESIZE | CACA_EVENT_QUIT;
+	struct pollfd fds[WALL_MAX_TILES + 1];
+	int i, num_fds = w->num_tiles + 1;
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	for (i = 0; i < w->num_tiles; i++) {
+		fds[i + 1].fd = vnc_notify_fd(&w->tiles[i].vnc);
+		fds[i + 1].events = POLLIN;
+	}
+	while (true) {
+		/* Handle all of the events that have arrived so far, keys go to the focused tile */
+		struct wall_tile *focused = &w->tiles[w->focus];
+		focused->viewer.input_arrival = perf_now_usec();
+		caca_event_t ev;
+		while (caca_get_event(w->disp, ev_accept, &ev, 0)) {
+			enum caca_event_type ev_type =
+			    caca_get_event_type(&ev);
+			if (ev_type & CACA_EVENT_QUIT) {
+				return;
+			}
+			if (ev_type & CACA_EVENT_RESIZE) {
+				if (w->native_output) {
+					caca_refresh_display(w->disp);
+					term_invalidate(&w->term);
+				}
+				wall_layout(w, true);
+				continue;
+			}
+			if (!(ev_type & CACA_EVENT_KEY_PRESS)) {
+				continue;
+			}
+			int ev_char = caca_get_event_key_ch(&ev);
+			focused->dirty = true;
+			/* Tab moves focus to the next tile, unless it is meant for VNC */
+			if (ev_char == CACA_KEY_TAB && !focused->viewer.input2vnc) {
+				viewer_flush_input(&focused->viewer);
+				w->focus = (w->focus + 1) % w->num_tiles;
+				focused = &w->tiles[w->focus];
+				focused->viewer.input_arrival = perf_now_usec();
+				focused->dirty = true;
+				continue;
+			}
+			if (!viewer_handle_key(&focused->viewer, ev_char)) {
+				return;
+			}
+		}
+		int timeout_ms = viewer_flush_input(&focused->viewer);
+		/*
+		 * Redraw the tiles that have changed, each no more often than its frame rate.
+		 * Sleep until the next input, update, or tile due for a redraw.
+		 */
+		long long now = perf_now_usec();
+		bool drawn = false;
+		for (i = 0; i < w->num_tiles; i++) {
+			struct wall_tile *t = &w->tiles[i];
+			if (vnc_take_notification(&t->vnc)) {
+				t->dirty = true;
+			}
+			if (!t->dirty) {
+				continue;
+			}
+			long long due = t->last_frame +
+			    ((i == w->focus) ? w->frame_intvl :
+			     w->unfocused_intvl);
+			if (now < due) {
+				int due_ms = (due - now + 999) / 1000;
+				if (timeout_ms < 0 || due_ms < timeout_ms) {
+					timeout_ms = due_ms;
+				}
+				continue;
+			}
+			t->dirty = false;
+			t->last_frame = now;
+			if (wall_render_tile(w, i)) {
+				drawn = true;
+			}
+		}
+		if (drawn) {
+			wall_output(w);
+		}
+		poll(fds, num_fds, timeout_ms);
+	}
+}
+
+void wall_terminate(struct wall *w)
+{
+	int i;
+	for (i = 0; i < w->num_tiles; i++) {
+		viewer_terminate(&w->tiles[i].viewer);
+	}
+	if (w->native_output) {
+		term_destroy(&w->term);
+	}
+	if (w->disp != NULL) {
+		caca_free_display(w->disp);
+	}
+	if (w->view != NULL) {
+		caca_free_canvas(w->view);
+	}
+	for (i = 0; i < w->num_tiles; i++) {
+		vnc_destroy(&w->tiles[i].vnc);
+	}
+	free(w->tiles);
+	memset(w, 0, sizeof(struct wall));
+}
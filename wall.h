@@ -0,0 +1,57 @@
+#ifndef WALL_H
+#define WALL_H
+
+#include <caca.h>
+#include <stdbool.h>
+#include "geo.h"
+#include "opt.h"
+#include "pool.h"
+#include "term.h"
+#include "viewer.h"
+#include "vnc.h"
+
+#define WALL_MAX_TILES 64
+/* Tiles without focus are redrawn at most this many times a second, the focused tile follows -maxfps. */
+#define WALL_UNFOCUSED_FPS 2
+
+/* A VNC session shown on a tile of the wall. */
+struct wall_tile {
+	struct vnc vnc;
+	struct viewer viewer;
+	/* Location of the tile on canvas of wall */
+	struct geo_rect rect;
+	/* Frame-buffer or controls have changed since the tile was last rendered */
+	bool dirty;
+	long long last_frame;
+};
+
+/*
+ * Several VNC sessions laid out as tiles on one terminal. Each tile has its own connection and
+ * viewer, and the wall renders all of them on one thread, whose scheduler redraws the focused tile
+ * at full frame rate and the others at WALL_UNFOCUSED_FPS. Tiles share the render pool, and the
+ * small size of a tile lets server scale frame-buffer down. Keyboard input goes to the focused tile.
+ */
+struct wall {
+	struct wall_tile *tiles;
+	int num_tiles, focus;
+	caca_display_t *disp;
+	caca_canvas_t *view;
+	/* Native terminal output, used in place of caca_refresh_display if native_output is set */
+	struct term term;
+	bool native_output;
+	long long frame_intvl, unfocused_intvl;
+};
+
+/*
+ * Connect to every host with the LibVNCClient options on command line, and lay the sessions out
+ * as tiles on a display, render on the threads of pool. A host that cannot be reached gets a tile
+ * shown as disconnected. Return false only on failure, which leaves nothing behind.
+ */
+bool wall_init(struct wall *w, struct opt *opt, struct pool *pool,
+	       int num_hosts, char **hosts, int argc, char **argv);
+/* Handle keyboard input and draw the tiles. Block caller until quit key is pressed and handled. */
+void wall_ev_loop(struct wall *w);
+/* Release all resources held by the wall and close the VNC connections. */
+void wall_terminate(struct wall *w);
+
+#endif